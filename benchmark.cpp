@@ -9,14 +9,31 @@
 #include <algorithm>
 #include <functional>
 #include <bitset>
+#include <random>
+#include <memory>
+#include <memory_resource>
+#include <thread>
 #include <boost/algorithm/string.hpp>
 #include <charconv>
+#include <sys/resource.h>
+#include <malloc.h>
 
 #include "trie.hpp"
 #include "tritrie.hpp"
 #include "flatritrie.hpp"
 #include "multitritrie.hpp"
-// #include "flat4.hpp"
+#include "flatidx.hpp"
+#include "flatleaf.hpp"
+#include "flatskip.hpp"
+#include "flatstrides.hpp"
+#include "dir24.hpp"
+#include "poptrie.hpp"
+#include "treebitmap.hpp"
+#include "flatimage.hpp"
+#include "replicated.hpp"
+#include "hash48.hpp"
+#include "dualstack.hpp"
+#include "tablehandle.hpp"
 
 #include "hashmap.hpp"
 #include "utils.hpp"
@@ -68,6 +85,59 @@ void test_map(const std::vector<std::string> &test_data,
     std::cout << std::endl;
 }
 
+void test_dir24(const std::vector<std::string> &test_data,
+                const std::vector<uint32_t> &test_queries) {
+    Tritrie::Dir24<> dir;
+    test_generation("Dir24", dir, test_data);
+    test_suite(dir, "Dir24", test_queries);
+    dir.debug();
+    std::cout << std::endl;
+}
+
+void test_poptrie(const std::vector<std::string> &test_data,
+                  const std::vector<uint32_t> &test_queries) {
+    Tritrie::Tritrie<6> tritrie;
+    test_generation("Tritrie<6> for Poptrie", tritrie, test_data);
+
+    Tritrie::Poptrie<> poptrie;
+    measure("Poptrie generation",
+            [&] () {
+                poptrie.build(tritrie);
+            });
+    test_suite(poptrie, "Poptrie", test_queries);
+    poptrie.debug();
+    std::cout << std::endl;
+}
+
+template<int STRIDE>
+void test_treebitmap(const std::string &name,
+                     const std::vector<std::string> &test_data,
+                     const std::vector<uint32_t> &test_queries) {
+    /* Directly from a prefix list */
+    Tritrie::TreeBitmap<STRIDE> tree;
+    test_generation("TreeBitmap" + name, tree, test_data);
+    test_suite(tree, "TreeBitmap" + name, test_queries);
+
+    const int queries_cnt = test_queries.size();
+    test_query_batch("TreeBitmap" + name + " batched positive random query test",
+                     tree,
+                     [&test_queries, queries_cnt] (int i) {
+                         return test_queries[i % queries_cnt];
+                     });
+    tree.debug();
+
+    /* And from a Tritrie, which expands unaligned prefixes */
+    Tritrie::Tritrie<STRIDE> tritrie;
+    test_generation("Tritrie" + name + " for TreeBitmap", tritrie, test_data);
+    Tritrie::TreeBitmap<STRIDE> tree_expanded;
+    measure("TreeBitmap" + name + " generation from Tritrie",
+            [&] () {
+                tree_expanded.build(tritrie);
+            });
+    tree_expanded.debug();
+    std::cout << std::endl;
+}
+
 void test_trie(const std::vector<std::string> &test_data,
                const std::vector<uint32_t> &test_queries) {
     Trie trie;
@@ -108,20 +178,938 @@ void test_tritrie(const std::string &name,
                 flatritrie.build(tritrie);
             });
     test_suite(flatritrie, "Flatritrie" + name, test_queries);
+
+    const int queries_cnt = test_queries.size();
+    test_query_batch("Flatritrie" + name + " batched positive random query test",
+                     flatritrie,
+                     [&test_queries, queries_cnt] (int i) {
+                         return test_queries[i % queries_cnt];
+                     });
     flatritrie.debug();
+
+    /* Index encoded layout, to compare RAM and speed with pointer layout */
+    Tritrie::FlatIdx<BITS> flatidx;
+    measure("FlatIdx" + name + " generation",
+            [&] () {
+                flatidx.build(tritrie);
+            });
+    test_suite(flatidx, "FlatIdx" + name, test_queries);
+    test_query_batch("FlatIdx" + name + " batched positive random query test",
+                     flatidx,
+                     [&test_queries, queries_cnt] (int i) {
+                         return test_queries[i % queries_cnt];
+                     });
+    flatidx.debug();
+
+    /* Leaf-pushed layout, compare Rep Neg / Rnd 1.5% with Flatritrie */
+    Tritrie::FlatLeaf<BITS> flatleaf;
+    measure("FlatLeaf" + name + " generation",
+            [&] () {
+                flatleaf.build(tritrie);
+            });
+    test_suite(flatleaf, "FlatLeaf" + name, test_queries);
+    flatleaf.debug();
+
+    /* Same random negative queries on both */
+    std::vector<uint32_t> negative;
+    while (negative.size() < 1000000) {
+        const uint32_t ip = fastrand();
+        if (flatritrie.query(ip) == -1) {
+            negative.push_back(ip);
+        }
+    }
+    volatile int sink = 0;
+    const uint64_t took_flat = measure("", [&] () {
+        for (const uint32_t ip: negative) {
+            sink += flatritrie.query(ip);
+        }
+    });
+    const uint64_t took_leaf = measure("", [&] () {
+        for (const uint32_t ip: negative) {
+            sink += flatleaf.query(ip);
+        }
+    });
+    assert(sink == -2 * (int)negative.size());
+    std::cout << "FlatLeaf" << name << " negative random queries: "
+              << 1.0 * took_leaf / negative.size() << " ns/q, Flatritrie: "
+              << 1.0 * took_flat / negative.size() << " ns/q -> "
+              << 1.0 * took_flat / took_leaf << "x speedup" << std::endl;
+    std::cout << std::endl;
+}
+
+/* Variable strides, compare with uniform Flatritrie */
+template<int... STRIDES>
+void test_strides(const std::string &name,
+                  const std::vector<std::string> &test_data,
+                  const std::vector<uint32_t> &test_queries) {
+    Tritrie::FlatStrides<STRIDES...> flat;
+    test_generation("FlatStrides" + name, flat, test_data);
+    test_suite(flat, "FlatStrides" + name, test_queries);
+    flat.debug();
+    std::cout << std::endl;
+}
+
+void test_strides_all(const std::vector<std::string> &test_data,
+                      const std::vector<uint32_t> &test_queries) {
+    test_strides<16, 8, 8>("<16, 8, 8>", test_data, test_queries);
+    test_strides<16, 8, 4, 4>("<16, 8, 4, 4>", test_data, test_queries);
+    test_strides<12, 4, 4, 4, 4, 4>("<12, 4, 4, 4, 4, 4>",
+                                    test_data, test_queries);
+    test_strides<8, 8, 8, 8>("<8, 8, 8, 8>", test_data, test_queries);
+}
+
+/* Compare Flat entry layout policies built from the same Tritrie */
+template<int BITS=8>
+void test_layouts(const std::string &name,
+                  const std::vector<std::string> &test_data,
+                  const std::vector<uint32_t> &test_queries) {
+    const std::vector<std::pair<std::string, Tritrie::Layout>> layouts = {
+        {"DFS", Tritrie::Layout::DFS},
+        {"BFS", Tritrie::Layout::BFS},
+        {"PAGE", Tritrie::Layout::PAGE},
+    };
+
+    Tritrie::Tritrie<BITS> tritrie;
+    test_generation("Tritrie" + name, tritrie, test_data);
+
+    for (auto &layout: layouts) {
+        Tritrie::Flat<BITS> flatritrie;
+        const std::string desc = "Flatritrie" + name + " " + layout.first;
+        measure(desc + " generation",
+                [&] () {
+                    flatritrie.build(tritrie, layout.second);
+                });
+        test_suite(flatritrie, desc, test_queries);
+    }
+    std::cout << std::endl;
+}
+
+/* Relayout Flat using a profile of skewed traffic and compare */
+template<int BITS=8>
+void test_skewed(const std::string &name,
+                 std::vector<std::string> &test_data) {
+    /* Separate representative trace and the measured traffic */
+    auto trace = get_skewed_test_data(test_data, 200, 1000000);
+    auto test_queries = get_skewed_test_data(test_data, 200);
+
+    Tritrie::Tritrie<BITS> tritrie;
+    test_generation("Tritrie" + name, tritrie, test_data);
+
+    Tritrie::Flat<BITS> flatritrie;
+    flatritrie.build(tritrie);
+    test_suite(flatritrie, "Flatritrie" + name + " skewed", test_queries);
+
+    typename Tritrie::Flat<BITS>::Profile profile;
+    measure("Flatritrie" + name + " profile recording",
+            [&] () {
+                for (auto ip: trace) {
+                    flatritrie.record(ip, profile);
+                }
+            });
+    std::cout << "Entries visited by trace " << profile.size() << std::endl;
+
+    measure("Flatritrie" + name + " relayout",
+            [&] () {
+                flatritrie.relayout(profile);
+            });
+    test_suite(flatritrie, "Flatritrie" + name + " skewed relayout",
+               test_queries);
+    std::cout << std::endl;
+}
+
+/* Compare scalar, batched and AVX2 FlatIdx queries per trie level */
+template<int BITS=8>
+void test_simd(const std::string &name,
+               const std::vector<std::string> &test_data,
+               const std::vector<uint32_t> &test_queries) {
+    Tritrie::Tritrie<BITS> tritrie;
+    test_generation("Tritrie" + name, tritrie, test_data);
+
+    Tritrie::FlatIdx<BITS> flatidx;
+    flatidx.build(tritrie);
+
+    const int burst = 256;
+    const int tests = 5000000 / burst * burst;
+    std::vector<uint32_t> ips(tests);
+    std::vector<int32_t> results(tests);
+    uint64_t levels = 0;
+    for (int i = 0; i < tests; i++) {
+        ips[i] = test_queries[i % test_queries.size()];
+        levels += flatidx.depth(ips[i]);
+    }
+    std::cout << "FlatIdx" << name << " average levels per query: "
+              << 1.0 * levels / tests << std::endl;
+
+    auto report = [&] (const std::string &desc, uint64_t took) {
+        std::cout << "  " << desc << ": "
+                  << tests / (took / 1e9) / 1e6 << " Mq/s; "
+                  << 1.0 * took / tests << " ns/q; "
+                  << 1.0 * took / levels << " ns/level"
+                  << std::endl;
+    };
+
+    report("scalar", measure("", [&] () {
+        for (int i = 0; i < tests; i++) {
+            results[i] = flatidx.query(ips[i]);
+        }
+    }));
+    report("batch", measure("", [&] () {
+        for (int i = 0; i < tests; i += burst) {
+            flatidx.query_batch(&ips[i], &results[i], burst);
+        }
+    }));
+    report("simd", measure("", [&] () {
+        for (int i = 0; i < tests; i += burst) {
+            flatidx.query_simd(&ips[i], &results[i], burst);
+        }
+    }));
+    std::cout << std::endl;
+}
+
+/* Compare heap and huge page backed Flat */
+template<int BITS=8>
+void test_backing(const std::string &name,
+                  const std::vector<std::string> &test_data,
+                  const std::vector<uint32_t> &test_queries) {
+    struct Policy {
+        std::string name;
+        Tritrie::Backing backing;
+        bool populate, lock, warm;
+    };
+    const std::vector<Policy> policies = {
+        {"heap", Tritrie::Backing::HEAP, false, false, false},
+        {"huge", Tritrie::Backing::HUGEPAGE, false, false, false},
+        {"huge populated locked warm", Tritrie::Backing::HUGEPAGE, true, true, true},
+    };
+
+    Tritrie::Tritrie<BITS> tritrie;
+    test_generation("Tritrie" + name, tritrie, test_data);
+
+    for (auto &policy: policies) {
+        Tritrie::Flat<BITS> flatritrie(policy.backing, policy.populate,
+                                       policy.lock);
+        const std::string desc = "Flatritrie" + name + " " + policy.name;
+        measure(desc + " generation",
+                [&] () {
+                    flatritrie.build(tritrie);
+                    if (policy.warm) {
+                        flatritrie.warm();
+                    }
+                });
+        std::cout << "  AnonHugePages: "
+                  << read_proc_kb("/proc/self/smaps_rollup", "AnonHugePages")
+                  << "kB" << std::endl;
+
+        /* Faults taken by the queries themselves */
+        rusage before, after;
+        getrusage(RUSAGE_SELF, &before);
+        test_suite(flatritrie, desc, test_queries);
+        getrusage(RUSAGE_SELF, &after);
+        std::cout << "  page faults during queries: "
+                  << after.ru_minflt - before.ru_minflt << std::endl;
+        flatritrie.debug();
+    }
+    std::cout << std::endl;
+}
+
+/* Startup from text versus from a mapped image */
+template<int BITS=8>
+void test_image(const std::string &name,
+                const std::vector<uint32_t> &test_queries) {
+    const std::string path = "flatritrie" + name + ".img";
+    Tritrie::Flat<BITS> flatritrie;
+    measure("Flatritrie" + name + " startup from text",
+            [&] () {
+                auto test_data = load_test_data("test_data.txt");
+                Tritrie::Tritrie<BITS> tritrie;
+                int id = 0;
+                for (auto &item: test_data) {
+                    tritrie.add(item, id++);
+                }
+                flatritrie.build(tritrie);
+            });
+    measure("Flatritrie" + name + " saving image",
+            [&] () {
+                flatritrie.save(path);
+            });
+
+    for (bool verify: {true, false}) {
+        Tritrie::FlatImage<BITS> image;
+        measure("FlatImage" + name + " startup from image"
+                + (verify ? " with checksum" : ""),
+                [&] () {
+                    image.open_mmap(path, verify);
+                });
+    }
+
+    Tritrie::FlatImage<BITS> image;
+    image.open_mmap(path);
+    test_suite(image, "FlatImage" + name, test_queries);
+    image.debug();
+    std::remove(path.c_str());
+    std::cout << std::endl;
+}
+
+/* Concurrent queries from a pinned thread on each NUMA node */
+template<int BITS=8>
+void test_replicated(const std::string &name,
+                     const std::vector<std::string> &test_data,
+                     const std::vector<uint32_t> &test_queries) {
+    Tritrie::Tritrie<BITS> tritrie;
+    test_generation("Tritrie" + name, tritrie, test_data);
+
+    Tritrie::Replicated<Tritrie::Flat<BITS>> replicated;
+    measure("Replicated Flatritrie" + name + " generation",
+            [&] () {
+                replicated.build([&tritrie] (Tritrie::Flat<BITS> &flat) {
+                    flat.build(tritrie);
+                });
+            });
+    replicated.debug();
+
+    const auto &numa = Tritrie::Numa::get();
+    const int tests = 5000000;
+    const int queries_cnt = test_queries.size();
+    /* Each node queries its local replica, then the replica of node 0 */
+    for (bool local: {true, false}) {
+        if (not local and numa.nodes() == 1) {
+            break;
+        }
+        std::vector<double> rates(numa.nodes());
+        std::vector<std::thread> readers;
+        for (int node = 0; node < numa.nodes(); node++) {
+            readers.emplace_back([&, node] () {
+                numa.pin_to_node(node);
+                const auto &table = local ? replicated.local() : replicated.replica(0);
+                int found = 0;
+                auto took = measure("", [&] () {
+                    for (int i = 0; i < tests; i++) {
+                        found += table.query(test_queries[i % queries_cnt]) != -1;
+                    }
+                });
+                rates[node] = tests / (took / 1e9) / 1e6;
+                assert(found == tests);
+            });
+        }
+        for (auto &reader: readers) {
+            reader.join();
+        }
+        for (int node = 0; node < numa.nodes(); node++) {
+            std::cout << "  node " << node
+                      << (local ? " local replica: " : " replica of node 0: ")
+                      << rates[node] << " Mq/s" << std::endl;
+        }
+    }
     std::cout << std::endl;
 }
 
-int main() {
+/* Query by network-order header bytes instead of host-order keys */
+template<int BITS=8>
+void test_bytes(const std::string &name,
+                const std::vector<std::string> &test_data,
+                const std::vector<uint32_t> &test_queries) {
+    Tritrie::Tritrie<BITS> tritrie;
+    test_generation("Tritrie" + name, tritrie, test_data);
+    Tritrie::Flat<BITS> flatritrie;
+    flatritrie.build(tritrie);
+
+    /* Addresses as they sit in packet headers */
+    const int tests = 5000000;
+    std::vector<uint32_t> headers(tests);
+    std::vector<const uint8_t *> addrs(tests);
+    for (int i = 0; i < tests; i++) {
+        headers[i] = htonl(test_queries[i % test_queries.size()]);
+        addrs[i] = (const uint8_t *)&headers[i];
+    }
+    std::vector<int32_t> results(tests);
+
+    auto report = [&] (const std::string &desc, uint64_t took) {
+        std::cout << "  Flatritrie" << name << " " << desc << ": "
+                  << tests / (took / 1e9) / 1e6 << " Mq/s; "
+                  << 1.0 * took / tests << " ns/q" << std::endl;
+    };
+    report("ntohl + query", measure("", [&] () {
+        for (int i = 0; i < tests; i++) {
+            results[i] = flatritrie.query(ntohl(*(const uint32_t *)addrs[i]));
+        }
+    }));
+    report("query_bytes", measure("", [&] () {
+        for (int i = 0; i < tests; i++) {
+            results[i] = flatritrie.query_bytes(addrs[i]);
+        }
+    }));
+    report("query_bytes_burst", measure("", [&] () {
+        const int burst = 32;
+        for (int i = 0; i < tests; i += burst) {
+            flatritrie.query_bytes_burst(&addrs[i], &results[i],
+                                         std::min(burst, tests - i));
+        }
+    }));
+    std::cout << std::endl;
+}
+
+/* IPv6 variant of test_suite */
+template<typename T>
+void test_suite_v6(T &algo, const std::string &name,
+                   const std::vector<Tritrie::uint128_t> &test_queries)
+{
+    std::cout << "== IPv6 Test Suite for " << name << std::endl;
+
+    const Tritrie::uint128_t ip_positive = test_queries[0];
+    /* Outside of 2000::/3 */
+    const Tritrie::uint128_t ip_negative = (Tritrie::uint128_t)0xfd12 << 112;
+    const int queries_cnt = test_queries.size();
+
+    test_query("True random query test",
+               algo,
+               [] (int i) {return fastrand128();});
+
+    test_query("Positive random query test",
+               algo,
+               [&test_queries, queries_cnt] (int i) {
+                 return test_queries[i % queries_cnt];
+               });
+
+    test_query("Repetitive positive query test",
+               algo,
+               [ip_positive] (int i) {return ip_positive;});
+
+    test_query("Repetitive negative query test",
+               algo,
+               [ip_negative] (int i) {return ip_negative;});
+}
+
+template<int BITS=8>
+void test_ipv6(const std::string &name,
+               const std::vector<std::string> &test_data,
+               const std::vector<Tritrie::uint128_t> &test_queries) {
+    Tritrie::Tritrie<BITS, Tritrie::uint128_t> tritrie;
+    test_generation("IPv6 Tritrie" + name, tritrie, test_data);
+    test_suite_v6(tritrie, "IPv6 Tritrie" + name, test_queries);
+
+    Tritrie::Flat<BITS, Tritrie::uint128_t> flatritrie;
+    measure("IPv6 Flatritrie" + name + " generation",
+            [&] () {
+                flatritrie.build(tritrie);
+            });
+    test_suite_v6(flatritrie, "IPv6 Flatritrie" + name, test_queries);
+    const int queries_cnt = test_queries.size();
+    test_query_batch("IPv6 Flatritrie" + name + " batched positive random query test",
+                     flatritrie,
+                     [&test_queries, queries_cnt] (int i) {
+                         return test_queries[i % queries_cnt];
+                     });
+    flatritrie.debug();
+    show_mem_usage(false);
+
+    Tritrie::Hash48<BITS> hash48;
+    measure("Hash48" + name + " generation",
+            [&] () {
+                hash48.build(tritrie);
+            });
+    test_suite_v6(hash48, "Hash48" + name, test_queries);
+    hash48.debug();
+    std::cout << std::endl;
+}
+
+/*
+ * Tables with all prefixes up to /64 take the high half only path. Kept
+ * small, as every IPv6 prefix costs up to 16 nodes of a Tritrie<8>.
+ */
+void test_ipv6_all() {
+    for (int max_mask: {64, 128}) {
+        std::cout << "=== IPv6 table with prefixes up to /"
+                  << max_mask << std::endl;
+        auto test_data = get_ipv6_test_data(20000, max_mask);
+        auto test_queries = get_rnd_test_data_v6(test_data);
+        test_ipv6<8>("<8>", test_data, test_queries);
+        test_ipv6<6>("<6>", test_data, test_queries);
+        test_ipv6<4>("<4>", test_data, test_queries);
+    }
+}
+
+/*
+ * Hash48 against Flat on a table of mostly /32 allocations, where most
+ * queries aren't in any /48 block and take the second probe.
+ */
+template<int BITS=8>
+void test_hash48(const std::string &name,
+                 const std::vector<std::string> &test_data,
+                 const std::vector<Tritrie::uint128_t> &test_queries) {
+    Tritrie::Tritrie<BITS, Tritrie::uint128_t> tritrie;
+    test_generation("IPv6 Tritrie" + name, tritrie, test_data);
+
+    Tritrie::Flat<BITS, Tritrie::uint128_t> flatritrie;
+    flatritrie.build(tritrie);
+    test_suite_v6(flatritrie, "IPv6 Flatritrie" + name, test_queries);
+
+    Tritrie::Hash48<BITS> hash48;
+    hash48.build(tritrie);
+    test_suite_v6(hash48, "Hash48" + name, test_queries);
+    hash48.debug();
+    std::cout << std::endl;
+}
+
+/* IPv4 queries of a dual-stack table against a plain IPv4 Flat */
+template<int BITS=8>
+void test_dualstack(const std::string &name,
+                    const std::vector<std::string> &test_data,
+                    const std::vector<uint32_t> &test_queries) {
+    Tritrie::Tritrie<BITS> tritrie;
+    test_generation("Tritrie" + name, tritrie, test_data);
+    Tritrie::Flat<BITS> flatritrie;
+    flatritrie.build(tritrie);
+    test_suite(flatritrie, "Flatritrie" + name, test_queries);
+
+    /* IPv6 part of the table shares the upper levels */
+    const auto test_data_v6 = get_ipv6_test_data(20000, 64);
+    Tritrie::DualStack<BITS> dualstack;
+    measure("DualStack" + name + " generation",
+            [&] () {
+                for (size_t i = 0; i < test_data_v6.size(); i++) {
+                    dualstack.add(test_data_v6[i], i);
+                }
+                for (size_t i = 0; i < test_data.size(); i++) {
+                    dualstack.add(test_data[i], i);
+                }
+                dualstack.build();
+            });
+    test_suite(dualstack, "DualStack" + name, test_queries);
+    test_suite_v6(dualstack, "DualStack" + name,
+                  get_rnd_test_data_v6(test_data_v6));
+    dualstack.debug();
+    std::cout << std::endl;
+}
+
+/* Path compression against Flat on the same Tritrie */
+template<int BITS, typename K, typename Suite>
+void test_skip(const std::string &name,
+               const std::vector<std::string> &test_data,
+               const std::vector<K> &test_queries,
+               Suite suite) {
+    Tritrie::Tritrie<BITS, K> tritrie;
+    test_generation("Tritrie" + name, tritrie, test_data);
+
+    Tritrie::Flat<BITS, K> flatritrie;
+    flatritrie.build(tritrie);
+    suite(flatritrie, "Flatritrie" + name);
+    flatritrie.debug();
+
+    Tritrie::FlatSkip<BITS, K> flatskip;
+    measure("FlatSkip" + name + " generation",
+            [&] () {
+                flatskip.build(tritrie);
+            });
+    suite(flatskip, "FlatSkip" + name);
+    flatskip.debug();
+
+    /* Entries visited by positive queries */
+    Tritrie::FlatIdx<BITS, K> flatidx;
+    flatidx.build(tritrie);
+    uint64_t depth = 0, depth_skip = 0;
+    for (auto &ip: test_queries) {
+        depth += flatidx.depth(ip);
+        depth_skip += flatskip.depth(ip);
+    }
+    std::cout << "  average depth: Flat " << 1.0 * depth / test_queries.size()
+              << " FlatSkip " << 1.0 * depth_skip / test_queries.size()
+              << std::endl << std::endl;
+}
+
+template<int BITS>
+void test_skip_all(const std::string &name,
+                   const std::vector<std::string> &test_data,
+                   const std::vector<uint32_t> &test_queries,
+                   const std::vector<std::string> &test_data_v6,
+                   const std::vector<Tritrie::uint128_t> &test_queries_v6) {
+    test_skip<BITS>(name, test_data, test_queries,
+                    [&] (auto &algo, const std::string &algo_name) {
+                        test_suite(algo, algo_name, test_queries);
+                    });
+    test_skip<BITS>(name + " IPv6", test_data_v6, test_queries_v6,
+                    [&] (auto &algo, const std::string &algo_name) {
+                        test_suite_v6(algo, algo_name, test_queries_v6);
+                    });
+}
+
+/* Building from sorted and unsorted networks gives the same table */
+template<typename T>
+void test_build_order(const std::string &name,
+                      const std::vector<std::string> &sorted,
+                      const std::vector<std::string> &unsorted,
+                      const std::vector<uint32_t> &test_queries) {
+    /* Value depends on the network only, not on its position */
+    auto value_of = [] (const std::string &network) {
+        return (int32_t)(std::hash<std::string>()(network) & 0xffff);
+    };
+
+    T from_sorted;
+    measure(name + " generation from sorted", [&] () {
+        for (auto &network: sorted) {
+            from_sorted.add(network, value_of(network));
+        }
+    });
+
+    T from_unsorted;
+    measure(name + " generation from unsorted", [&] () {
+        for (auto &network: unsorted) {
+            from_unsorted.add(network, value_of(network));
+        }
+    });
+
+    int mismatches = 0;
+    for (auto ip: test_queries) {
+        mismatches += from_sorted.query(ip) != from_unsorted.query(ip);
+    }
+    std::cout << "  nodes " << from_sorted.size() << " / " << from_unsorted.size()
+              << "; mismatched queries " << mismatches << std::endl;
+}
+
+template<int BITS=8>
+void test_build(const std::string &name,
+                const std::vector<std::string> &sorted,
+                const std::vector<std::string> &unsorted,
+                const std::vector<uint32_t> &test_queries) {
+    test_build_order<Tritrie::Tritrie<BITS>>(
+        "Tritrie" + name, sorted, unsorted, test_queries);
+    test_build_order<Tritrie::MultiTritrie<BITS>>(
+        "MultiTritrie" + name, sorted, unsorted, test_queries);
+    std::cout << std::endl;
+}
+
+/* Start measuring the peak RSS from now; returns current RSS in kB */
+long reset_peak_rss() {
+    /* Freed heap would hide the allocations of the next build */
+    malloc_trim(0);
+    std::ofstream("/proc/self/clear_refs") << "5";
+    return read_proc_kb("/proc/self/status", "VmHWM");
+}
+
+/* Networks as numeric prefixes, valued by their position */
+std::vector<Tritrie::Prefix<uint32_t, int32_t>> get_prefixes(
+    const std::vector<std::string> &test_data) {
+    std::vector<Tritrie::Prefix<uint32_t, int32_t>> prefixes;
+    prefixes.reserve(test_data.size());
+    for (auto &network: test_data) {
+        uint32_t ip;
+        int mask;
+        Tritrie::parse_ip<uint32_t>(network, ip, mask);
+        prefixes.push_back({ip, (uint8_t)mask, (int32_t)prefixes.size()});
+    }
+    return prefixes;
+}
+
+/* Flat through a Tritrie versus built directly from numeric prefixes */
+template<int BITS=8>
+void test_bulk(const std::string &name,
+               const std::vector<std::string> &test_data,
+               const std::vector<uint32_t> &test_queries) {
+    const auto prefixes = get_prefixes(test_data);
+
+    auto report = [] (long base_kb) {
+        std::cout << "  peak RSS growth: "
+                  << read_proc_kb("/proc/self/status", "VmHWM") - base_kb
+                  << "kB" << std::endl;
+    };
+
+    {
+        Tritrie::Flat<BITS> flatritrie;
+        long base_kb = reset_peak_rss();
+        measure("Tritrie + Flatritrie" + name + " generation", [&] () {
+            Tritrie::Tritrie<BITS> tritrie;
+            for (auto &prefix: prefixes) {
+                tritrie.add(prefix.ip, prefix.len, prefix.value);
+            }
+            flatritrie.build(tritrie);
+        });
+        report(base_kb);
+        test_suite(flatritrie, "Flatritrie" + name + " through Tritrie",
+                   test_queries);
+        flatritrie.debug();
+    }
+
+    /* Kept as the reference for parallel builds */
+    Tritrie::Flat<BITS> serial;
+    long base_kb = reset_peak_rss();
+    const uint64_t took_serial = measure(
+        "Flatritrie" + name + " direct generation", [&] () {
+            serial.build(prefixes.data(), prefixes.size());
+        });
+    report(base_kb);
+    test_suite(serial, "Flatritrie" + name + " direct", test_queries);
+    serial.debug();
+
+    /* Subtrees of root children built in parallel */
+    const int cores = std::thread::hardware_concurrency();
+    std::cout << "Parallel direct generation on " << cores << " cores:" << std::endl;
+    const size_t sample = std::min<size_t>(test_queries.size(), 1000000);
+    for (int threads: {2, 4, 8, 16}) {
+        Tritrie::Flat<BITS> flatritrie;
+        const uint64_t took = measure(
+            "Flatritrie" + name + " direct generation, "
+            + std::to_string(threads) + " threads", [&] () {
+                flatritrie.build(prefixes.data(), prefixes.size(), threads);
+            });
+        std::cout << "  speedup over serial: " << 1.0 * took_serial / took
+                  << "x" << std::endl;
+
+        /* Same answers as the serial build */
+        for (size_t i = 0; i < sample; i++) {
+            if (flatritrie.query(test_queries[i]) != serial.query(test_queries[i])) {
+                throw std::runtime_error("Parallel build differs from the serial one");
+            }
+        }
+    }
+    std::cout << std::endl;
+}
+
+/* Nodes on the heap versus from a bump allocator */
+template<typename T>
+void test_arena_nodes(const std::string &name,
+                      const std::vector<std::string> &test_data,
+                      const std::vector<uint32_t> &test_queries) {
+    {
+        std::unique_ptr<T> trie(new T());
+        test_generation(name + " heap", *trie, test_data);
+        test_suite(*trie, name + " heap", test_queries);
+        measure(name + " heap teardown", [&] () {
+            trie.reset();
+        });
+    }
+
+    {
+        std::pmr::monotonic_buffer_resource arena;
+        std::unique_ptr<T> trie(new T(&arena));
+        test_generation(name + " arena", *trie, test_data);
+        test_suite(*trie, name + " arena", test_queries);
+        measure(name + " arena teardown", [&] () {
+            trie.reset();
+            arena.release();
+        });
+    }
+    std::cout << std::endl;
+}
+
+template<int BITS=8>
+void test_arena(const std::string &name,
+                const std::vector<std::string> &test_data,
+                const std::vector<uint32_t> &test_queries) {
+    test_arena_nodes<Tritrie::Tritrie<BITS>>(
+        "Tritrie" + name, test_data, test_queries);
+    test_arena_nodes<Tritrie::MultiTritrie<BITS>>(
+        "MultiTritrie" + name, test_data, test_queries);
+}
+
+/* Query throughput and latency while the table gets replaced */
+template<int BITS=8>
+void test_reload(const std::string &name,
+                 const std::vector<std::string> &test_data,
+                 const std::vector<uint32_t> &test_queries) {
+    using Table = Tritrie::Flat<BITS>;
+    using Clock = std::chrono::steady_clock;
+    const auto prefixes = get_prefixes(test_data);
+
+    Tritrie::TableHandle<Table> handle([&prefixes] (Table &table) {
+        table.build(prefixes.data(), prefixes.size());
+    });
+
+    const int readers = std::max(1u, std::thread::hardware_concurrency() - 1);
+    const int seconds = 4;
+    /* Latency histogram in ns; the last bucket takes the rest */
+    constexpr int BUCKETS = 100000;
+
+    for (bool reloading: {false, true}) {
+        std::atomic<bool> stop(false);
+        std::vector<std::vector<uint64_t>> histograms(
+            readers, std::vector<uint64_t>(BUCKETS));
+        std::vector<uint64_t> slowest(readers);
+        const int generations = handle.generations();
+
+        std::vector<std::thread> threads;
+        for (int r = 0; r < readers; r++) {
+            threads.emplace_back([&, r] () {
+                typename Tritrie::TableHandle<Table>::Reader reader(handle);
+                auto &histogram = histograms[r];
+                const size_t count = test_queries.size();
+                int32_t sink = 0;
+                for (size_t i = r; not stop.load(std::memory_order_relaxed); i++) {
+                    const auto start = Clock::now();
+                    sink += reader.query(test_queries[i % count]);
+                    const uint64_t took = std::chrono::duration_cast<
+                        std::chrono::nanoseconds>(Clock::now() - start).count();
+                    histogram[std::min<uint64_t>(took, BUCKETS - 1)]++;
+                    slowest[r] = std::max(slowest[r], took);
+                }
+                /* Keep the queries */
+                if (sink == 42) {
+                    std::cout << std::endl;
+                }
+            });
+        }
+
+        for (int second = 0; second < seconds; second++) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            if (reloading) {
+                handle.request_reload();
+            }
+        }
+        stop = true;
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        std::vector<uint64_t> merged(BUCKETS);
+        uint64_t total = 0, max_ns = 0;
+        for (int r = 0; r < readers; r++) {
+            for (int b = 0; b < BUCKETS; b++) {
+                merged[b] += histograms[r][b];
+                total += histograms[r][b];
+            }
+            max_ns = std::max(max_ns, slowest[r]);
+        }
+        auto percentile = [&merged, total] (double p) {
+            const uint64_t rank = total * p;
+            uint64_t seen = 0;
+            for (int b = 0; b < BUCKETS; b++) {
+                seen += merged[b];
+                if (seen > rank) {
+                    return b;
+                }
+            }
+            return BUCKETS - 1;
+        };
+
+        std::cout << "TableHandle Flatritrie" << name
+                  << (reloading ? " reloaded every second" : " without reloads")
+                  << ", " << readers << " readers:" << std::endl
+                  << "  queries " << total << " -> "
+                  << total / seconds / 1e6 << " Mq/s (timed one by one)" << std::endl
+                  << "  latency p50 " << percentile(0.5)
+                  << "ns p99 " << percentile(0.99)
+                  << "ns p99.9 " << percentile(0.999)
+                  << "ns p99.99 " << percentile(0.9999)
+                  << "ns max " << max_ns << "ns" << std::endl
+                  << "  reloads " << handle.generations() - generations << std::endl;
+    }
+    handle.debug();
+    std::cout << std::endl;
+}
+
+int main(int argc, char **argv) {
     #ifndef NDEBUG
     std::cout << "Watchout - for good results use benchmarks with RELEASE=1"
               << std::endl;
     #endif
 
+    /* Selects a group of tests; all the structures by default */
+    const std::string mode = argc > 1 ? argv[1] : "all";
+
     /* Prepare subnet data and query data */
     auto test_data = load_test_data("test_data.txt");
     auto test_queries = get_rnd_test_data(test_data);
 
+    if (mode == "layouts") {
+        test_layouts<8>("<8>", test_data, test_queries);
+        test_layouts<6>("<6>", test_data, test_queries);
+        test_layouts<4>("<4>", test_data, test_queries);
+        return 0;
+    } else if (mode == "strides") {
+        test_strides_all(test_data, test_queries);
+        return 0;
+    } else if (mode == "skewed") {
+        test_skewed<8>("<8>", test_data);
+        test_skewed<6>("<6>", test_data);
+        test_skewed<4>("<4>", test_data);
+        return 0;
+    } else if (mode == "simd") {
+        test_simd<8>("<8>", test_data, test_queries);
+        test_simd<6>("<6>", test_data, test_queries);
+        test_simd<4>("<4>", test_data, test_queries);
+        return 0;
+    } else if (mode == "hugepages") {
+        test_backing<8>("<8>", test_data, test_queries);
+        test_backing<6>("<6>", test_data, test_queries);
+        test_backing<4>("<4>", test_data, test_queries);
+        return 0;
+    } else if (mode == "image") {
+        test_image<8>("<8>", test_queries);
+        test_image<6>("<6>", test_queries);
+        test_image<4>("<4>", test_queries);
+        return 0;
+    } else if (mode == "numa") {
+        test_replicated<8>("<8>", test_data, test_queries);
+        test_replicated<6>("<6>", test_data, test_queries);
+        test_replicated<4>("<4>", test_data, test_queries);
+        return 0;
+    } else if (mode == "bytes") {
+        test_bytes<8>("<8>", test_data, test_queries);
+        test_bytes<6>("<6>", test_data, test_queries);
+        test_bytes<4>("<4>", test_data, test_queries);
+        return 0;
+    } else if (mode == "ipv6") {
+        test_ipv6_all();
+        return 0;
+    } else if (mode == "hash48") {
+        const auto test_data_v6 = get_ipv6_short_test_data(100000);
+        const auto test_queries_v6 = get_rnd_test_data_v6(test_data_v6);
+        test_hash48<8>("<8>", test_data_v6, test_queries_v6);
+        test_hash48<6>("<6>", test_data_v6, test_queries_v6);
+        test_hash48<4>("<4>", test_data_v6, test_queries_v6);
+        return 0;
+    } else if (mode == "dualstack") {
+        test_dualstack<8>("<8>", test_data, test_queries);
+        test_dualstack<6>("<6>", test_data, test_queries);
+        test_dualstack<4>("<4>", test_data, test_queries);
+        return 0;
+    } else if (mode == "skip") {
+        const auto test_data_v6 = get_ipv6_test_data(20000);
+        const auto test_queries_v6 = get_rnd_test_data_v6(test_data_v6);
+        test_skip_all<8>("<8>", test_data, test_queries,
+                         test_data_v6, test_queries_v6);
+        test_skip_all<6>("<6>", test_data, test_queries,
+                         test_data_v6, test_queries_v6);
+        test_skip_all<4>("<4>", test_data, test_queries,
+                         test_data_v6, test_queries_v6);
+        return 0;
+    } else if (mode == "build") {
+        /* Sorting isn't needed anymore - compare with the whole load */
+        std::vector<std::string> unsorted;
+        measure("Loading unsorted test data", [&] () {
+            unsorted = load_test_data("test_data.txt", false);
+        });
+        std::shuffle(unsorted.begin(), unsorted.end(), std::mt19937(1));
+        measure("Loading sorted test data", [&] () {
+            load_test_data("test_data.txt");
+        });
+        test_build<8>("<8>", test_data, unsorted, test_queries);
+        test_build<6>("<6>", test_data, unsorted, test_queries);
+        test_build<4>("<4>", test_data, unsorted, test_queries);
+        return 0;
+    } else if (mode == "bulk") {
+        /* Optionally on another prefix list or GeoLite2 blocks .csv */
+        if (argc > 2) {
+            test_data = load_data(argv[2]);
+            test_queries = get_rnd_test_data(test_data);
+        }
+        test_bulk<8>("<8>", test_data, test_queries);
+        test_bulk<6>("<6>", test_data, test_queries);
+        test_bulk<4>("<4>", test_data, test_queries);
+        return 0;
+    } else if (mode == "arena") {
+        test_arena<8>("<8>", test_data, test_queries);
+        test_arena<6>("<6>", test_data, test_queries);
+        test_arena<4>("<4>", test_data, test_queries);
+        return 0;
+    } else if (mode == "reload") {
+        test_reload<8>("<8>", test_data, test_queries);
+        test_reload<6>("<6>", test_data, test_queries);
+        test_reload<4>("<4>", test_data, test_queries);
+        return 0;
+    } else if (mode != "all") {
+        std::cout << "Unknown benchmark mode " << mode << std::endl;
+        return 1;
+    }
+
     /* To get accurate RAM measurements, test one structure at a time */
     show_mem_usage(true);
     test_trie(test_data, test_queries);
@@ -135,6 +1123,21 @@ int main() {
     show_mem_usage(true);
     test_tritrie<4>("<4>", test_data, test_queries);
 
+    show_mem_usage(true);
+    test_strides_all(test_data, test_queries);
+
+    show_mem_usage(true);
+    test_dir24(test_data, test_queries);
+
+    show_mem_usage(true);
+    test_poptrie(test_data, test_queries);
+
+    show_mem_usage(true);
+    test_treebitmap<4>("<4>", test_data, test_queries);
+
+    show_mem_usage(true);
+    test_treebitmap<5>("<5>", test_data, test_queries);
+
     show_mem_usage(true);
     test_map(test_data, test_queries);
     return 0;
@@ -16,8 +16,9 @@
 
 #include "tritrie.hpp"
 #include "flatritrie.hpp"
+#include "poptrie.hpp"
+#include "dualstack.hpp"
 #include "utils.hpp"
-// #include "flat4.hpp"
 
 const int POLAND = 798544;
 const int BITS = 4;
@@ -71,24 +72,7 @@ auto geo_example() {
                 read_csv("GeoLite2-Country-Blocks-IPv4.csv", net_loader);
             });
 
-    /* Sort by mask */
-    std::sort(geo_data.begin(),
-              geo_data.end(),
-              [](const auto &a, const auto &b) {
-                  const auto &addr_a = a.first;
-                  const auto &addr_b = b.first;
-                  int mask_a = 0, mask_b = 0;
-                  size_t found = addr_a.find("/");
-                  assert(found != std::string::npos);
-                  std::from_chars(addr_a.data() + found+1,
-                                  addr_a.data() + addr_a.size(), mask_a);
-
-                  found = addr_b.find("/");
-                  std::from_chars(addr_b.data() + found+1,
-                                  addr_b.data() + addr_b.size(), mask_b);
-                  return mask_a < mask_b;
-              });
-
+    /* Tritrie takes networks in any order - no need to sort them */
     Tritrie::Tritrie<BITS> tritrie;
     measure("Tritrie generation for GeoIP Database",
             [&tritrie, &geo_data] () {
@@ -134,8 +118,103 @@ auto geo_example() {
                flatritrie,
                [] (int i) {return fastrand();},
                tests);
+
+    /* Compare entry layout policies on the full database */
+    const std::vector<std::pair<std::string, Tritrie::Layout>> layouts = {
+        {"BFS", Tritrie::Layout::BFS},
+        {"PAGE", Tritrie::Layout::PAGE},
+    };
+    for (auto &layout: layouts) {
+        measure("Flatritrie " + layout.first + " generation",
+                [&] () {
+                    flatritrie.build(tritrie, layout.second);
+                });
+        test_query("Flatritrie " + layout.first + " random geo query test",
+                   flatritrie,
+                   [] (int i) {return fastrand();},
+                   tests);
+    }
+
+    /*
+     * Poptrie, built from its own Tritrie<6>
+     */
+    Tritrie::Poptrie<> poptrie;
+    {
+        Tritrie::Tritrie<6> tritrie6;
+        measure("Tritrie<6> generation for Poptrie",
+                [&tritrie6, &geo_data] () {
+                    for (auto &item: geo_data) {
+                        tritrie6.add(item.first, item.second);
+                    }
+                });
+        measure("Poptrie generation",
+                [&] () {
+                    poptrie.build(tritrie6);
+                });
+    }
+    poptrie.debug();
+
+    ret = poptrie.query_string("96.17.148.229");
+    if (ret != POLAND)
+        throw std::exception();
+
+    test_query("Poptrie random geo query test",
+               poptrie,
+               [] (int i) {return fastrand();},
+               tests);
+}
+
+/* Both GeoLite2 block files in a single dual-stack table */
+void geo_dualstack_example() {
+    using DualStack = Tritrie::DualStack<BITS>;
+
+    std::vector<std::pair<std::string, int>> geo_data;
+    auto net_loader = \
+        [&geo_data] (auto &row) {
+            int geoname_id = -1;
+            if (row[1].size() > 0) {
+                geoname_id = std::stoi(row[1]);
+            } else if (row[2].size() > 0) {
+                geoname_id = std::stoi(row[2]);
+            }
+            geo_data.push_back({row[0], geoname_id});
+        };
+
+    measure("Reading GeoIP IPv4 and IPv6 Databases",
+            [&net_loader] () {
+                read_csv("GeoLite2-Country-Blocks-IPv4.csv", net_loader);
+                read_csv("GeoLite2-Country-Blocks-IPv6.csv", net_loader);
+            });
+
+    DualStack dualstack;
+    measure("DualStack generation",
+            [&] () {
+                for (auto &item: geo_data) {
+                    dualstack.add(item.first, item.second);
+                }
+                dualstack.build();
+            });
+    dualstack.debug();
+
+    int ret = dualstack.query_string("96.17.148.229");
+    if (ret != POLAND)
+        throw std::exception();
+
+    show_mem_usage();
+
+    test_query("DualStack random IPv4 geo query test",
+               dualstack,
+               [] (int i) {return fastrand();});
+
+    test_query("DualStack random IPv6 geo query test",
+               dualstack,
+               [] (int i) {
+                   /* Within 2000::/3 */
+                   return ((Tritrie::uint128_t)1 << 125) | (fastrand128() >> 3);
+               });
 }
 
 int main() {
     geo_example();
+    geo_dualstack_example();
 }
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _DIR24_H_
+#define _DIR24_H_
+
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <unordered_map>
+#include <tritrie.hpp>
+
+namespace Tritrie {
+
+/*
+ * DIR-24-8 direct indexed table for IPv4 (Gupta, Lin, McKeown).
+ *
+ * First table is indexed directly by the top 24 bits of an address. Prefixes
+ * up to /24 are expanded into it; a slot covered by a longer prefix points
+ * instead to a 256 entry extension block indexed by the last byte.
+ *
+ * Integral values of up to 32 bits are stored in the 31-bit slots, so a
+ * lookup takes one read, or two dependent ones within a longer prefix.
+ * Wider values are kept in a table of distinct values (one entry per value,
+ * which is not small for GeoIP) and take one more dependent read.
+ *
+ * Uses 64MB for the first table regardless of the data. Filled from prefixes
+ * sorted by mask, like Tritrie.
+ */
+template<typename V=int32_t, V def=-1>
+class Dir24 {
+protected:
+    constexpr static int TBL24_SIZE = 1 << 24;
+    constexpr static int BLOCK_SIZE = 256;
+
+    /* Slot in tbl24 points to an extension block */
+    constexpr static uint32_t EXTENDED = 0x80000000u;
+
+    /* Values are stored in the slots instead of their indices */
+    constexpr static bool DIRECT = std::is_integral<V>::value && sizeof(V) <= 4;
+
+    /* Values (or their indices) or EXTENDED | block number */
+    std::vector<uint32_t> tbl24;
+    /* Extension blocks; values or their indices */
+    std::vector<uint32_t> tbllong;
+
+    /* Distinct values without DIRECT; 0 is always 'def' */
+    std::vector<V> values;
+    std::unordered_map<V, uint32_t> value_ids;
+
+    /* Value in the lower 31 bits of a slot; signed ones are sign-extended */
+    constexpr static bool fits(V value) {
+        if constexpr (std::is_signed<V>::value) {
+            return (int64_t)value >= -(1LL << 30) && (int64_t)value < (1LL << 30);
+        } else {
+            return (uint64_t)value < EXTENDED;
+        }
+    }
+
+    static uint32_t pack(V value) {
+        return (uint32_t)value & ~EXTENDED;
+    }
+
+    static V unpack(uint32_t slot) {
+        if constexpr (std::is_signed<V>::value) {
+            return (V)((int32_t)(slot << 1) >> 1);
+        } else {
+            return (V)slot;
+        }
+    }
+
+    /* Mask during insertion can only grow or stay the same */
+    int last_mask = 0;
+
+    uint32_t value_index(V value) {
+        if constexpr (DIRECT) {
+            if (!fits(value)) {
+                throw std::runtime_error("Value doesn't fit in a Dir24 slot");
+            }
+            return pack(value);
+        }
+        auto found = this->value_ids.find(value);
+        if (found != this->value_ids.end()) {
+            return found->second;
+        }
+        const uint32_t idx = this->values.size();
+        if (idx >= EXTENDED) {
+            throw std::runtime_error("Too many distinct values for Dir24");
+        }
+        this->values.push_back(value);
+        this->value_ids[value] = idx;
+        return idx;
+    }
+
+    void add_ip(uint32_t ip, int mask, V value) {
+        if (mask < this->last_mask) {
+            std::cerr << "Inserting mask " << mask
+                      << " after mask " << this->last_mask << std::endl;
+            throw std::runtime_error("Invalid order of IP insertion to Dir24");
+        }
+        this->last_mask = mask;
+
+        const uint32_t idx = this->value_index(value);
+
+        if (mask <= 24) {
+            /* Longer prefixes come later, so there are no blocks here yet */
+            const uint32_t span = 1u << (24 - mask);
+            const uint32_t first = (ip >> 8) & ~(span - 1);
+            std::fill(this->tbl24.begin() + first,
+                      this->tbl24.begin() + first + span, idx);
+            return;
+        }
+
+        uint32_t &slot = this->tbl24[ip >> 8];
+        if ((slot & EXTENDED) == 0) {
+            /* Create a block inheriting the /24 (or shorter) match */
+            const uint32_t block = this->tbllong.size() / BLOCK_SIZE;
+            if (block >= EXTENDED) {
+                throw std::runtime_error("Too many extension blocks for Dir24");
+            }
+            this->tbllong.resize(this->tbllong.size() + BLOCK_SIZE, slot);
+            slot = EXTENDED | block;
+        }
+
+        const uint32_t block = slot & ~EXTENDED;
+        const uint32_t span = 1u << (32 - mask);
+        const uint32_t first = block * BLOCK_SIZE + ((ip & 0xff) & ~(span - 1));
+        std::fill(this->tbllong.begin() + first,
+                  this->tbllong.begin() + first + span, idx);
+    }
+
+    /* Don't copy. */
+    Dir24(const Dir24 &dir);
+
+public:
+    Dir24() {
+        if constexpr (DIRECT) {
+            static_assert(fits(def), "Default value must fit in a Dir24 slot");
+            this->tbl24.assign(TBL24_SIZE, pack(def));
+        } else {
+            this->tbl24.assign(TBL24_SIZE, 0);
+            this->values.push_back(def);
+            this->value_ids[def] = 0;
+        }
+    }
+
+    void add(const std::string addr_mask, V value) {
+        uint32_t ip;
+        int mask;
+        parse_ip<uint32_t>(addr_mask, ip, mask);
+        if (mask == -1) {
+            throw std::runtime_error("Address without a mask");
+        }
+        if (mask < 0 || mask > 32)
+            throw std::runtime_error("Invalid mask");
+        this->add_ip(ip, mask, value);
+    }
+
+    V query_string(const std::string &addr) const {
+        in_addr ip_parsed;
+        int ret = inet_aton(addr.c_str(), &ip_parsed);
+        if (ret == 0)
+            throw std::exception();
+
+        uint32_t ip_network = ntohl(ip_parsed.s_addr);
+        return this->query(ip_network);
+    }
+
+    V query(uint32_t ip) const {
+        uint32_t slot = this->tbl24[ip >> 8];
+        if (slot & EXTENDED) {
+            slot = this->tbllong[(slot & ~EXTENDED) * BLOCK_SIZE + (ip & 0xff)];
+        }
+        if constexpr (DIRECT) {
+            return unpack(slot);
+        }
+        return this->values[slot];
+    }
+
+    /* Number of extension blocks */
+    int size() const {
+        return this->tbllong.size() / BLOCK_SIZE;
+    }
+
+    /* Bytes used by tables */
+    size_t memory() const {
+        return (this->tbl24.capacity() * sizeof(uint32_t)
+                + this->tbllong.capacity() * sizeof(uint32_t)
+                + this->values.capacity() * sizeof(V));
+    }
+
+    void debug() {
+        std::cout << "Dir24 debug stats:" << std::endl
+                  << "  extension blocks = " << this->size() << std::endl
+                  << "  distinct values = "
+                  << (DIRECT ? "stored in slots" : std::to_string(this->values.size()))
+                  << std::endl
+                  << "  memory = " << this->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+};
+#endif
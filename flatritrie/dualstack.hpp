@@ -0,0 +1,187 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _DUALSTACK_H_
+#define _DUALSTACK_H_
+
+#include <memory>
+#include <utility>
+#include <tritrie.hpp>
+#include <flatritrie.hpp>
+
+namespace Tritrie {
+
+/*
+ * IPv4 and IPv6 networks in a single IPv6 table.
+ *
+ * IPv4 networks are stored as IPv4-mapped addresses, within the
+ * ::ffff:0:0/96 subtree, so a.b.c.d/m becomes ::ffff:a.b.c.d/(96+m). After
+ * build the Flat entry of that subtree is looked up once; IPv4 queries start
+ * there and take as many levels as a Flat<BITS, uint32_t> would.
+ *
+ * Networks of both families can be added in any order. IPv4 queries only
+ * match IPv4 networks. Table is built once: build() frees the Tritrie, and
+ * adding networks or building again afterwards throws.
+ */
+template<int BITS=8, typename V=int32_t, V def=-1>
+class DualStack {
+protected:
+    using Table = Flat<BITS, uint128_t, V, def>;
+    using Entry = typename Table::Entry;
+    using Halves = typename Table::Halves;
+
+    static_assert(96 % BITS == 0, "Flat levels must end on the /96 boundary");
+
+    /* ::ffff:0:0/96 */
+    constexpr static uint64_t V4_MAPPED = 0xffff00000000ULL;
+    constexpr static int V4_SHIFT = 96;
+    /* Levels above the IPv4 subtree and within it */
+    constexpr static int V4_DEPTH = V4_SHIFT / BITS;
+    constexpr static int V4_LEVELS = Table::LEVELS - V4_DEPTH;
+
+    /* Networks to build from; NULL once built */
+    std::unique_ptr<Tritrie<BITS, uint128_t, V, def>> trie;
+    Table flat;
+
+    /*
+     * Value of 0.0.0.0/0 (or ::ffff:0:0/96). Shorter IPv6 networks expand
+     * into the same Flat entry, so it can't be taken from there.
+     */
+    V v4_default = def;
+
+    /* Root of the IPv4 subtree; NULL without IPv4 networks */
+    const Entry *v4_root = NULL;
+    V v4_root_value = def;
+
+    /* Tritrie nodes of the last build, for debug */
+    int trie_nodes = 0;
+
+    void add_mapped(uint128_t ip, int mask, V value) {
+        if (!this->trie) {
+            throw std::runtime_error("DualStack is already built");
+        }
+        if (ip == V4_MAPPED && mask == V4_SHIFT) {
+            this->v4_default = value;
+        }
+        this->trie->add(ip, mask, value);
+    }
+
+    template<size_t... L>
+    V query_v4_unrolled(uint32_t ip, std::index_sequence<L...>) const {
+        const Entry *cur = this->v4_root;
+        V matched = this->v4_root_value;
+        const Halves key{0, V4_MAPPED | ip};
+        auto noop = [] (const Entry *) {};
+        (void)(Table::step(Table::template chunk<V4_DEPTH + L>(key),
+                           cur, matched, noop) && ...);
+        return matched;
+    }
+
+    /* Don't copy. */
+    DualStack(const DualStack &dualstack);
+
+public:
+    DualStack() : trie(new Tritrie<BITS, uint128_t, V, def>()) {}
+
+    /* Add an IPv4 or an IPv6 network */
+    void add(const std::string &addr_mask, V value) {
+        if (addr_mask.find(':') != std::string::npos) {
+            uint128_t ip;
+            int mask;
+            parse_ip<uint128_t>(addr_mask, ip, mask);
+            if (mask == -1) {
+                throw std::runtime_error("Address without a mask");
+            }
+            if (mask < 0 || mask > 128)
+                throw std::runtime_error("Invalid mask");
+            this->add_mapped(ip, mask, value);
+            return;
+        }
+        uint32_t ip;
+        int mask;
+        parse_ip<uint32_t>(addr_mask, ip, mask);
+        if (mask == -1) {
+            throw std::runtime_error("Address without a mask");
+        }
+        if (mask < 0 || mask > 32)
+            throw std::runtime_error("Invalid mask");
+        this->add_mapped((uint128_t)(V4_MAPPED | ip), V4_SHIFT + mask, value);
+    }
+
+    /* Build the Flat and free the Tritrie */
+    void build(Layout layout = Layout::DFS) {
+        if (!this->trie) {
+            throw std::runtime_error("DualStack is already built");
+        }
+        this->flat.build(*this->trie, layout);
+        this->trie_nodes = this->trie->size();
+        this->trie.reset();
+        const V v4_default = this->v4_default;
+
+        /* Descend to the IPv4 subtree once */
+        const uint128_t key = V4_MAPPED;
+        const Entry *cur = &this->flat.pages[0][0];
+        this->v4_root = NULL;
+        this->v4_root_value = def;
+        for (int level = 0; level < V4_DEPTH; level++) {
+            const int shift = 128 - (level + 1) * BITS;
+            const int slot = (int)(key >> shift) & ((1 << BITS) - 1);
+            cur = cur->child[slot];
+            if (cur == NULL) {
+                return;
+            }
+        }
+        this->v4_root = cur;
+        /* Shorter IPv6 networks don't cover IPv4 - only 0.0.0.0/0 does */
+        this->v4_root_value = v4_default;
+    }
+
+    V query_string(const std::string &addr) const {
+        if (addr.find(':') != std::string::npos) {
+            return this->flat.query_string(addr);
+        }
+        uint32_t ip;
+        int mask;
+        parse_ip<uint32_t>(addr, ip, mask);
+        if (mask != -1 && mask != 32) {
+            throw std::runtime_error("Query with partial mask.");
+        }
+        return this->query(ip);
+    }
+
+    V query(uint32_t ip) const {
+        if (this->v4_root == NULL) {
+            return def;
+        }
+        return this->query_v4_unrolled(ip, std::make_index_sequence<V4_LEVELS>());
+    }
+
+    V query(uint128_t ip) const {
+        return this->flat.query(ip);
+    }
+
+    int size() const {
+        return this->flat.size();
+    }
+
+    /* Bytes used by the Flat; the Tritrie is freed by build() */
+    size_t memory() const {
+        return this->flat.memory();
+    }
+
+    void debug() {
+        std::cout << "DualStack debug stats:" << std::endl
+                  << "  tritrie nodes = " << this->trie_nodes << std::endl
+                  << "  flat entries = " << this->flat.size() << std::endl
+                  << "  IPv4 subtree = "
+                  << (this->v4_root != NULL ? "present" : "empty") << std::endl
+                  << "  memory = " << this->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+};
+#endif
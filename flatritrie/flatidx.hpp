@@ -0,0 +1,318 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _FLATIDX_H_
+#define _FLATIDX_H_
+
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <tritrie.hpp>
+#include <flatimage.hpp>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace Tritrie {
+
+/*
+ * Flatritrie variant with 32-bit index encoded children.
+ *
+ * Works like Flat, but instead of pointers each Entry stores indices into a
+ * single contiguous entry table and values are kept in a separate, parallel
+ * table. This halves the size of an entry on 64-bit machines - an Entry for
+ * BITS=4 is exactly 64 bytes and is aligned to fit a single cache line.
+ *
+ * Index 0 is always the root which can't be anybody's child, so 0 in a child
+ * slot means "no child".
+ */
+template<int BITS=8, typename K=uint32_t, typename V=int32_t, V def=-1>
+class FlatIdx {
+protected:
+    constexpr static int BITS_TOTAL = std::numeric_limits<K>::digits;
+    constexpr static int CHILDREN = (1<<BITS);
+    constexpr static int BITS_COMPLEMENT = (BITS_TOTAL - BITS);
+
+    /* Number of lookups walked in lockstep by query_batch */
+    constexpr static int BATCH = 16;
+
+    /* Lookups walked in lockstep by a single AVX2 register */
+    constexpr static int LANES = 8;
+
+    /* Don't let small entries straddle the cache line boundary */
+    constexpr static size_t ENTRY_ALIGN = std::min<size_t>(
+        64, CHILDREN * sizeof(uint32_t));
+
+    struct alignas(ENTRY_ALIGN) Entry {
+        /* {000 -> 5, 001 -> 0 (none), 010 -> 6, ...} for BITS=3 */
+        uint32_t child[CHILDREN] = {};
+    };
+
+    /* Single growable table; values[i] belongs to entries[i] */
+    std::vector<Entry> entries;
+    std::vector<V> values;
+
+    uint32_t alloc_entry() {
+        const size_t idx = this->entries.size();
+        if (idx > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("FlatIdx entry table overflow");
+        }
+        this->entries.emplace_back();
+        this->values.push_back(def);
+        return idx;
+    }
+
+    uint32_t build_node(typename Tritrie<BITS, K, V, def>::Node *node) {
+        const uint32_t idx = this->alloc_entry();
+        this->values[idx] = node->value;
+
+        for (int i = 0; i < CHILDREN; i++) {
+            if (node->child[i] != NULL) {
+                /* Table might get reallocated during the recursion */
+                const uint32_t child = build_node(node->child[i]);
+                this->entries[idx].child[i] = child;
+            }
+        }
+        return idx;
+    }
+
+#if defined(__x86_64__)
+    /* Gathers index 32-bit words with a signed 32-bit offset */
+    bool gather_fits() const {
+        return (this->entries.size() * CHILDREN
+                <= (size_t)std::numeric_limits<int32_t>::max());
+    }
+
+    /* Walk eight IPv4 lookups through the levels in AVX2 registers */
+    __attribute__((target("avx2")))
+    void query_avx2(const K *ips, V *out, size_t n) const {
+        const int *table = (const int *)this->entries.data();
+        const int *values = (const int *)this->values.data();
+
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i none = _mm256_set1_epi32((int32_t)def);
+        const __m256i root = _mm256_set1_epi32((int32_t)this->values[0]);
+
+        size_t i = 0;
+        for (; i + LANES <= n; i += LANES) {
+            __m256i ip = _mm256_loadu_si256((const __m256i *)&ips[i]);
+            __m256i cur = zero;
+            __m256i matched = root;
+            /* Lanes which still have somewhere to run */
+            __m256i active = _mm256_cmpeq_epi32(zero, zero);
+
+            for (;;) {
+                const __m256i tri = _mm256_srli_epi32(ip, BITS_COMPLEMENT);
+                const __m256i slot = _mm256_add_epi32(
+                    _mm256_slli_epi32(cur, BITS), tri);
+                const __m256i child = _mm256_mask_i32gather_epi32(
+                    zero, table, slot, active, 4);
+
+                active = _mm256_andnot_si256(
+                    _mm256_cmpeq_epi32(child, zero), active);
+                if (_mm256_testz_si256(active, active)) {
+                    /* All lanes are done */
+                    break;
+                }
+
+                const __m256i value = _mm256_mask_i32gather_epi32(
+                    none, values, child, active, 4);
+                const __m256i found = _mm256_andnot_si256(
+                    _mm256_cmpeq_epi32(value, none), active);
+                matched = _mm256_blendv_epi8(matched, value, found);
+                cur = _mm256_blendv_epi8(cur, child, active);
+                ip = _mm256_slli_epi32(ip, BITS);
+            }
+            _mm256_storeu_si256((__m256i *)&out[i], matched);
+        }
+
+        /* Tail */
+        for (; i < n; i++) {
+            out[i] = this->query(ips[i]);
+        }
+    }
+#endif
+
+    void cleanup() {
+        this->entries.clear();
+        this->values.clear();
+    }
+
+    /* Don't copy. */
+    FlatIdx(const FlatIdx &flatritrie);
+
+public:
+    FlatIdx() {}
+
+    void build(Tritrie<BITS, K, V, def> &trie) {
+        this->cleanup();
+        /* Tritrie nodes + root */
+        this->entries.reserve(trie.size() + 1);
+        this->values.reserve(trie.size() + 1);
+        this->build_node(&trie.root);
+    }
+
+    V query_string(const std::string &addr) const {
+        K ip;
+        int mask;
+        parse_ip<K>(addr, ip, mask);
+        if (mask != -1 && mask != BITS_TOTAL) {
+            throw std::runtime_error("Query with partial mask.");
+        }
+        return this->query(ip);
+    }
+
+    V query(K ip) const {
+        /* Querying uninitialized structure will fail */
+        assert(this->entries.size() > 0);
+
+        const Entry *table = this->entries.data();
+        const V *values = this->values.data();
+
+        uint32_t cur = 0;
+        V matched = values[0];
+        for (;;) {
+            const int tri = ip >> BITS_COMPLEMENT;
+            const uint32_t child = table[cur].child[tri];
+
+            if (child == 0) {
+                /* Nowhere to run */
+                return matched;
+            }
+            cur = child;
+            if (values[cur] != def) {
+                matched = values[cur];
+            }
+            ip <<= BITS;
+        }
+        return matched;
+    }
+
+    /**
+     * Query a burst of addresses at once, storing results in out[0..n).
+     * Works like Flat::query_batch, but prefetches from the index tables.
+     */
+    void query_batch(const K *ips, V *out, size_t n) const {
+        /* Querying uninitialized structure will fail */
+        assert(this->entries.size() > 0);
+
+        const Entry *table = this->entries.data();
+        const V *values = this->values.data();
+
+        struct Lane {
+            uint32_t cur;
+            K ip;
+            V matched;
+            size_t pos;
+        } lanes[BATCH];
+
+        size_t next = 0;
+        int active = 0;
+        for (; active < BATCH && next < n; active++, next++) {
+            lanes[active] = {0, ips[next], def, next};
+        }
+
+        while (active > 0) {
+            for (int i = 0; i < active;) {
+                Lane &lane = lanes[i];
+
+                /* Entry was prefetched during the previous round */
+                if (values[lane.cur] != def) {
+                    lane.matched = values[lane.cur];
+                }
+
+                const uint32_t child =
+                    table[lane.cur].child[lane.ip >> BITS_COMPLEMENT];
+                if (child == 0) {
+                    /* Nowhere to run - retire the lane or refill it */
+                    out[lane.pos] = lane.matched;
+                    if (next < n) {
+                        lane = {0, ips[next], def, next};
+                        next++;
+                        i++;
+                    } else {
+                        lane = lanes[--active];
+                    }
+                    continue;
+                }
+
+                lane.ip <<= BITS;
+                __builtin_prefetch(&values[child]);
+                __builtin_prefetch(&table[child].child[lane.ip >> BITS_COMPLEMENT]);
+                lane.cur = child;
+                i++;
+            }
+        }
+    }
+
+    /**
+     * Query a burst of addresses using AVX2 gathers, eight at a time.
+     * Falls back to query_batch without AVX2 or for non 32-bit K or V.
+     */
+    void query_simd(const K *ips, V *out, size_t n) const {
+        /* Querying uninitialized structure will fail */
+        assert(this->entries.size() > 0);
+
+#if defined(__x86_64__)
+        if constexpr (std::is_same<K, uint32_t>::value
+                      and std::is_integral<V>::value and sizeof(V) == 4) {
+            static const bool avx2 = __builtin_cpu_supports("avx2");
+            if (avx2 and this->gather_fits()) {
+                this->query_avx2(ips, out, n);
+                return;
+            }
+        }
+#endif
+        this->query_batch(ips, out, n);
+    }
+
+    /* Write the tables as an image; query it with FlatImage::open_mmap */
+    void save(const std::string &path) const {
+        /* Querying uninitialized structure will fail */
+        assert(this->entries.size() > 0);
+
+        ImageWriter<BITS, K, V, def> writer(path, this->entries.size());
+        for (const Entry &entry: this->entries) {
+            writer.write_row(entry.child);
+        }
+        writer.finish(this->values);
+    }
+
+    /* Number of entries visited by a query, including the root */
+    int depth(K ip) const {
+        uint32_t cur = 0;
+        int visited = 1;
+        while (uint32_t child = this->entries[cur].child[ip >> BITS_COMPLEMENT]) {
+            cur = child;
+            ip <<= BITS;
+            visited++;
+        }
+        return visited;
+    }
+
+    int size() const {
+        return this->entries.size();
+    }
+
+    /* Bytes used by entry and value tables */
+    size_t memory() const {
+        return (this->entries.capacity() * sizeof(Entry)
+                + this->values.capacity() * sizeof(V));
+    }
+
+    void debug() {
+        std::cout << "FlatIdx debug stats:" << std::endl
+                  << "  entries total = " << this->entries.size()
+                  << " of " << sizeof(Entry) << "B" << std::endl
+                  << "  memory = " << this->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+};
+#endif
@@ -0,0 +1,357 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _FLATIMAGE_H_
+#define _FLATIMAGE_H_
+
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <vector>
+#include <utility>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tritrie.hpp>
+
+namespace Tritrie {
+
+/*
+ * Position independent image of a Flat or FlatIdx table.
+ *
+ * Layout of the file, each section aligned to 64 bytes:
+ * - ImageHeader,
+ * - child table: CHILDREN 32-bit entry indices per entry, 0 means no child,
+ * - value table: one V per entry.
+ *
+ * Entry 0 is the root. The checksum covers both tables.
+ */
+struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t bits;
+    uint32_t key_bits;
+    uint32_t value_size;
+    int64_t value_def;
+    uint64_t entries;
+    uint64_t checksum;
+    uint8_t reserved[16];
+};
+static_assert(sizeof(ImageHeader) == 64, "Header must keep tables aligned");
+
+constexpr char IMAGE_MAGIC[8] = "FLATIMG";
+constexpr uint32_t IMAGE_VERSION = 1;
+constexpr size_t IMAGE_ALIGN = 64;
+
+/* FNV-1a over 32-bit words */
+struct ImageChecksum {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    void word(uint32_t word) {
+        this->hash = (this->hash ^ word) * 0x100000001b3ULL;
+    }
+
+    void update(const void *data, size_t bytes) {
+        assert(bytes % sizeof(uint32_t) == 0);
+        const char *words = (const char *)data;
+        for (size_t i = 0; i < bytes; i += sizeof(uint32_t)) {
+            uint32_t word;
+            std::memcpy(&word, words + i, sizeof(word));
+            this->word(word);
+        }
+    }
+};
+
+static size_t image_aligned(size_t bytes) {
+    return (bytes + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+}
+
+/**
+ * Streams an image to a file. Child rows are written one entry at a time
+ * in index order, followed by all values. File is written under a temporary
+ * name and renamed in place when complete.
+ */
+template<int BITS, typename K, typename V, V def>
+class ImageWriter {
+protected:
+    static_assert(std::is_trivially_copyable<V>::value,
+                  "Values are stored in the image verbatim");
+
+    constexpr static int CHILDREN = (1<<BITS);
+
+    const std::string path;
+    const std::string path_tmp;
+    std::ofstream file;
+    ImageChecksum checksum;
+    ImageHeader header = {};
+    uint64_t rows = 0;
+
+    void pad(size_t bytes) {
+        const char zeros[IMAGE_ALIGN] = {};
+        const size_t padding = image_aligned(bytes) - bytes;
+        this->file.write(zeros, padding);
+        this->checksum.update(zeros, padding);
+    }
+
+public:
+    ImageWriter(const std::string &path, size_t entries)
+        : path(path), path_tmp(path + ".tmp"),
+          file(path_tmp, std::ios::binary | std::ios::trunc) {
+        if (!this->file) {
+            throw std::runtime_error("Unable to create image " + this->path_tmp);
+        }
+        std::memcpy(this->header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+        this->header.version = IMAGE_VERSION;
+        this->header.bits = BITS;
+        this->header.key_bits = std::numeric_limits<K>::digits;
+        this->header.value_size = sizeof(V);
+        this->header.value_def = (int64_t)def;
+        this->header.entries = entries;
+        /* Rewritten with the checksum by finish() */
+        this->file.write((const char *)&this->header, sizeof(this->header));
+    }
+
+    void write_row(const uint32_t (&child)[CHILDREN]) {
+        this->file.write((const char *)child, sizeof(child));
+        this->checksum.update(child, sizeof(child));
+        this->rows++;
+    }
+
+    void finish(const std::vector<V> &values) {
+        if (this->rows != this->header.entries or values.size() != this->rows) {
+            throw std::runtime_error("Image entry count mismatch");
+        }
+        this->pad(this->rows * sizeof(uint32_t) * CHILDREN);
+
+        /* Padding keeps the value table a whole number of words */
+        std::vector<char> value_table(image_aligned(values.size() * sizeof(V)));
+        std::memcpy(value_table.data(), values.data(), values.size() * sizeof(V));
+        this->file.write(value_table.data(), value_table.size());
+        this->checksum.update(value_table.data(), value_table.size());
+
+        this->header.checksum = this->checksum.hash;
+        this->file.seekp(0);
+        this->file.write((const char *)&this->header, sizeof(this->header));
+        this->file.close();
+        if (!this->file) {
+            throw std::runtime_error("Unable to write image " + this->path_tmp);
+        }
+        if (std::rename(this->path_tmp.c_str(), this->path.c_str()) != 0) {
+            throw std::runtime_error("Unable to rename image to " + this->path);
+        }
+    }
+};
+
+/*
+ * Read-only Flat queried directly from a mapped image file.
+ *
+ * Without verification nothing is parsed nor copied on open - pages of the
+ * file are faulted in by the first queries which touch them (or up front
+ * with warm()), and are shared by all processes mapping the same image.
+ * Queries range check each child index they follow, so a corrupt image can
+ * give wrong results, but never reads outside of the mapping.
+ */
+template<int BITS=8, typename K=uint32_t, typename V=int32_t, V def=-1>
+class FlatImage {
+protected:
+    constexpr static int BITS_TOTAL = std::numeric_limits<K>::digits;
+    constexpr static int CHILDREN = (1<<BITS);
+
+    /* Child reads of the longest path; last level can be shorter than BITS */
+    constexpr static int LEVELS = (BITS_TOTAL + BITS - 1) / BITS;
+
+    void *mapping = NULL;
+    size_t mapped = 0;
+
+    const uint32_t *children = NULL;
+    const V *values = NULL;
+    size_t entries = 0;
+
+    void cleanup() {
+        if (this->mapping != NULL) {
+            munmap(this->mapping, this->mapped);
+        }
+        this->mapping = NULL;
+        this->mapped = 0;
+        this->children = NULL;
+        this->values = NULL;
+        this->entries = 0;
+    }
+
+    /* Child slot of a level, aligned like in Flat::chunk */
+    template<int L>
+    static int chunk(K ip) {
+        constexpr int shift = BITS_TOTAL - (L + 1) * BITS;
+        if constexpr (shift >= 0) {
+            return (int)(ip >> shift) & (CHILDREN - 1);
+        } else {
+            return (int)(ip << -shift) & (CHILDREN - 1);
+        }
+    }
+
+    /* Descend a single level; false when there's nowhere to run */
+    bool step(int slot, uint32_t &cur, V &matched) const {
+        const uint32_t child = this->children[(size_t)cur * CHILDREN + slot];
+        if (child == 0 or child >= this->entries) {
+            /* Nowhere to run, or a corrupt index */
+            return false;
+        }
+        cur = child;
+        if (this->values[cur] != def) {
+            matched = this->values[cur];
+        }
+        return true;
+    }
+
+    /*
+     * Levels are unrolled like in Flat::walk; the walk is bounded by LEVELS
+     * even if the image links entries into a cycle.
+     */
+    template<size_t... L>
+    V walk_unrolled(K ip, std::index_sequence<L...>) const {
+        uint32_t cur = 0;
+        V matched = this->values[0];
+        (void)(this->step(chunk<L>(ip), cur, matched) && ...);
+        return matched;
+    }
+
+    /* Don't copy. */
+    FlatImage(const FlatImage &image);
+
+public:
+    FlatImage() {}
+
+    ~FlatImage() {
+        this->cleanup();
+    }
+
+    /**
+     * Map an image written by Flat::save or FlatIdx::save. Verification
+     * reads the whole file to check the checksum and every child index up
+     * front; skip it for trusted images to open in constant time.
+     */
+    void open_mmap(const std::string &path, bool verify = true) {
+        this->cleanup();
+
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::runtime_error("Unable to open image " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 or (size_t)st.st_size < sizeof(ImageHeader)) {
+            close(fd);
+            throw std::runtime_error("Truncated image " + path);
+        }
+        void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            throw std::runtime_error("Unable to map image " + path);
+        }
+        this->mapping = mem;
+        this->mapped = st.st_size;
+
+        ImageHeader header;
+        std::memcpy(&header, mem, sizeof(header));
+        if (std::memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0
+            or header.version != IMAGE_VERSION) {
+            this->cleanup();
+            throw std::runtime_error("Not a flatritrie image " + path);
+        }
+        if (header.bits != BITS or header.key_bits != BITS_TOTAL
+            or header.value_size != sizeof(V) or header.value_def != (int64_t)def) {
+            this->cleanup();
+            throw std::runtime_error("Image type mismatch " + path);
+        }
+
+        /* Bound entries first, so the table sizes can't overflow */
+        const size_t row_bytes = CHILDREN * sizeof(uint32_t);
+        if (header.entries == 0 or header.entries > this->mapped / row_bytes) {
+            this->cleanup();
+            throw std::runtime_error("Invalid image size " + path);
+        }
+        const size_t child_words = header.entries * CHILDREN;
+        const size_t child_bytes = image_aligned(child_words * sizeof(uint32_t));
+        const size_t value_bytes = image_aligned(header.entries * sizeof(V));
+        if (sizeof(header) + child_bytes + value_bytes != this->mapped) {
+            this->cleanup();
+            throw std::runtime_error("Invalid image size " + path);
+        }
+
+        const char *base = (const char *)mem;
+        if (verify) {
+            /* Child indices are checked in the same pass as the checksum */
+            const char *tables = base + sizeof(header);
+            ImageChecksum checksum;
+            for (size_t i = 0; i < child_words; i++) {
+                uint32_t child;
+                std::memcpy(&child, tables + i * sizeof(child), sizeof(child));
+                if (child >= header.entries) {
+                    this->cleanup();
+                    throw std::runtime_error("Invalid child index in image " + path);
+                }
+                checksum.word(child);
+            }
+            const size_t checked = child_words * sizeof(uint32_t);
+            checksum.update(tables + checked, child_bytes + value_bytes - checked);
+            if (checksum.hash != header.checksum) {
+                this->cleanup();
+                throw std::runtime_error("Image checksum mismatch " + path);
+            }
+        }
+
+        this->entries = header.entries;
+        this->children = (const uint32_t *)(base + sizeof(header));
+        this->values = (const V *)(base + sizeof(header) + child_bytes);
+    }
+
+    V query_string(const std::string &addr) const {
+        K ip;
+        int mask;
+        parse_ip<K>(addr, ip, mask);
+        if (mask != -1 && mask != BITS_TOTAL) {
+            throw std::runtime_error("Query with partial mask.");
+        }
+        return this->query(ip);
+    }
+
+    V query(K ip) const {
+        /* Querying unmapped image will fail */
+        assert(this->entries > 0);
+
+        return this->walk_unrolled(ip, std::make_index_sequence<LEVELS>());
+    }
+
+    /* Fault in the whole mapping */
+    void warm() const {
+        volatile char sink = 0;
+        const char *mem = (const char *)this->mapping;
+        for (size_t offset = 0; offset < this->mapped; offset += 4096) {
+            sink = sink + mem[offset];
+        }
+    }
+
+    int size() const {
+        return this->entries;
+    }
+
+    /* Bytes of the mapped file */
+    size_t memory() const {
+        return this->mapped;
+    }
+
+    void debug() {
+        std::cout << "FlatImage debug stats:" << std::endl
+                  << "  entries total = " << this->entries << std::endl
+                  << "  mapped = " << this->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+};
+#endif
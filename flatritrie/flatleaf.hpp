@@ -0,0 +1,185 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _FLATLEAF_H_
+#define _FLATLEAF_H_
+
+#include <limits>
+#include <vector>
+#include <type_traits>
+#include <tritrie.hpp>
+
+namespace Tritrie {
+
+/*
+ * Leaf-pushed Flatritrie.
+ *
+ * Values are pushed down from the inner nodes into the empty child slots
+ * below them, so each child slot holds either a pointer to the next Entry or
+ * a tagged value of the best match for this path. Query stops on the first
+ * tagged slot - there's no "matched" to track, Entry has no value field to
+ * read on each level and Tritrie nodes without children need no Entry at
+ * all; their values live inline in the parent's slot.
+ *
+ * Entries are at least pointer aligned, so the lowest bit tags a value.
+ */
+template<int BITS=8,
+         typename K=uint32_t, typename V=int32_t,
+         V def=-1, int PAGE_SIZE=10000>
+class FlatLeaf {
+protected:
+    static_assert(std::is_integral<V>::value && sizeof(V) < sizeof(uintptr_t),
+                  "Value must fit in a tagged child slot");
+
+    constexpr static int BITS_TOTAL = std::numeric_limits<K>::digits;
+    constexpr static int CHILDREN = (1<<BITS);
+    constexpr static int BITS_COMPLEMENT = (BITS_TOTAL - BITS);
+
+    struct Entry {
+        /* Entry pointer or (value << 1) | 1 */
+        uintptr_t child[CHILDREN];
+    };
+
+    /* Alocating multiple pages at once to improve cache locality */
+    std::vector<Entry *> pages;
+    Entry *page_current = 0;
+    int used_in_page = 0;
+    int used_total = 0;
+
+    /* Tritrie nodes stored inline as a tagged value */
+    int leaves_inlined = 0;
+
+    static uintptr_t tag(V value) {
+        return ((uintptr_t)(intptr_t)value << 1) | 1;
+    }
+
+    static V untag(uintptr_t slot) {
+        return (V)((intptr_t)slot >> 1);
+    }
+
+    Entry *alloc_entry() {
+        /* Allocate new page if required */
+        if (used_in_page == PAGE_SIZE or page_current == NULL) {
+            this->page_current = new Entry[PAGE_SIZE];
+            this->pages.push_back(this->page_current);
+            used_in_page = 0;
+        }
+
+        /* Alloc entry within a page */
+        Entry *entry = &this->page_current[this->used_in_page];
+        this->used_in_page++;
+        this->used_total++;
+        return entry;
+    }
+
+    Entry *build_entry(typename Tritrie<BITS, K, V, def>::Node *node,
+                       V inherited) {
+        Entry *entry = this->alloc_entry();
+        for (int i = 0; i < CHILDREN; i++) {
+            entry->child[i] = build_slot(node->child[i], inherited);
+        }
+        return entry;
+    }
+
+    uintptr_t build_slot(typename Tritrie<BITS, K, V, def>::Node *node,
+                         V inherited) {
+        if (node == NULL) {
+            /* Empty slot: best match from above */
+            return tag(inherited);
+        }
+
+        const V value = node->value != def ? node->value : inherited;
+        for (int i = 0; i < CHILDREN; i++) {
+            if (node->child[i] != NULL) {
+                return (uintptr_t)this->build_entry(node, value);
+            }
+        }
+
+        /* Leaf - no entry required */
+        this->leaves_inlined++;
+        return tag(value);
+    }
+
+    void cleanup() {
+        for (auto *page: this->pages) {
+            delete[] page;
+        }
+        this->pages.clear();
+        this->used_in_page = 0;
+        this->used_total = 0;
+        this->page_current = NULL;
+        this->leaves_inlined = 0;
+    }
+
+    /* Don't copy. */
+    FlatLeaf(const FlatLeaf &flatritrie);
+
+public:
+    FlatLeaf() {}
+
+    ~FlatLeaf() {
+        this->cleanup();
+    }
+
+    void build(Tritrie<BITS, K, V, def> &trie) {
+        this->cleanup();
+        /* Root is always an entry */
+        const V root_value = trie.root.value;
+        this->build_entry(&trie.root, root_value);
+    }
+
+    V query_string(const std::string &addr) const {
+        K ip;
+        int mask;
+        parse_ip<K>(addr, ip, mask);
+        if (mask != -1 && mask != BITS_TOTAL) {
+            throw std::runtime_error("Query with partial mask.");
+        }
+        return this->query(ip);
+    }
+
+    V query(K ip) const {
+        /* Querying uninitialized structure will fail */
+        assert(this->used_total > 0);
+
+        const Entry *cur = &this->pages[0][0];
+        for (;;) {
+            const int tri = ip >> BITS_COMPLEMENT;
+            const uintptr_t slot = cur->child[tri];
+            if (slot & 1) {
+                return untag(slot);
+            }
+            cur = (const Entry *)slot;
+            ip <<= BITS;
+        }
+    }
+
+    int size() const {
+        return this->used_total;
+    }
+
+    /* Bytes used by allocated pages */
+    size_t memory() const {
+        return this->pages.size() * PAGE_SIZE * sizeof(Entry);
+    }
+
+    void debug() {
+        const int plain = this->used_total + this->leaves_inlined;
+        std::cout << "FlatLeaf debug stats:" << std::endl
+                  << "  allocated pages = " << this->pages.size()
+                  << " of size " << PAGE_SIZE << std::endl
+                  << "  entries total = " << this->used_total
+                  << " of " << sizeof(Entry) << "B" << std::endl
+                  << "  leaves inlined = " << this->leaves_inlined
+                  << " -> " << 100.0 * this->leaves_inlined / plain
+                  << "% less entries than Flat" << std::endl
+                  << "  memory = " << this->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+};
+#endif
@@ -9,10 +9,47 @@
 
 #include <limits>
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <sys/mman.h>
 #include <tritrie.hpp>
+#include <flatimage.hpp>
 
 namespace Tritrie {
 
+/* Order in which Flat::build places entries within its pages */
+enum class Layout {
+    /* Depth-first: each subtree is stored in one continuous run */
+    DFS,
+    /* Breadth-first: the hot top levels are packed together */
+    BFS,
+    /* Subtrees are grouped within 4kB memory pages to save on TLB misses */
+    PAGE,
+};
+
+/* Memory backing Flat pages */
+enum class Backing {
+    /* Regular heap allocation, 4kB pages */
+    HEAP,
+    /* 2MB pages: MAP_HUGETLB if any are reserved, transparent ones otherwise */
+    HUGEPAGE,
+};
+
+/* Network given numerically, for building a Flat without a Tritrie */
+template<typename K=uint32_t, typename V=int32_t>
+struct Prefix {
+    K ip;
+    uint8_t len;
+    V value;
+};
+
 /*
  * A specialized dictionary-like structure for mapping keys (IP addresses) to
  * values (like int or pointer). Solves efficiently a problem which in hardware
@@ -37,6 +74,27 @@ protected:
     constexpr static int CHILDREN = (1<<BITS);
     constexpr static int BITS_COMPLEMENT = (BITS_TOTAL - BITS);
 
+    /* Child reads of the longest path; last level can be shorter than BITS */
+    constexpr static int LEVELS = (BITS_TOTAL + BITS - 1) / BITS;
+
+    /* Levels reading only the high 64 bits of an IPv6 key */
+    constexpr static int LEVELS_HIGH = (64 + BITS - 1) / BITS;
+
+    /* IPv6 key split into 64-bit halves */
+    struct Halves {
+        uint64_t high;
+        uint64_t low;
+    };
+
+    /* Number of lookups walked in lockstep by query_batch */
+    constexpr static int BATCH = 16;
+
+    /* Memory page size assumed by the Layout::PAGE */
+    constexpr static size_t MEM_PAGE = 4096;
+
+    /* Huge page size used by Backing::HUGEPAGE */
+    constexpr static size_t HUGE_PAGE = 2 * 1024 * 1024;
+
     struct Entry {
         /* VALUE if reached this place */
         V value = def;
@@ -51,10 +109,107 @@ protected:
     int used_in_page = 0;
     int used_total = 0;
 
+    /* Page allocation policy; fixed for the lifetime of the Flat */
+    const Backing backing = Backing::HEAP;
+    const bool populate = false;
+    const bool lock = false;
+
+    /* Pages which got MAP_HUGETLB memory */
+    std::atomic<int> pages_hugetlb{0};
+
+    /* No prefix longer than /64 - low half of IPv6 keys never matters */
+    bool high_only = false;
+
+    /* Child of already placed entry, waiting for its own place */
+    struct Pending {
+        typename Tritrie<BITS, K, V, def>::Node *node;
+        Entry **slot;
+    };
+
+    /* Bytes allocated for a single page */
+    size_t page_bytes() const {
+        const size_t bytes = PAGE_SIZE * sizeof(Entry);
+        const size_t unit = (this->backing == Backing::HUGEPAGE
+                             ? HUGE_PAGE : MEM_PAGE);
+        return (bytes + unit - 1) / unit * unit;
+    }
+
+    /* Map huge page backed memory, reserved or transparent */
+    void *map_huge(size_t bytes) {
+        const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        const int populate = this->populate ? MAP_POPULATE : 0;
+
+        void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                         flags | MAP_HUGETLB | populate, -1, 0);
+        if (mem != MAP_FAILED) {
+            this->pages_hugetlb++;
+            return mem;
+        }
+
+        /* Transparent huge pages need a 2MB aligned range - trim a larger one */
+        const size_t mapped = bytes + HUGE_PAGE;
+        char *raw = (char *)mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                                 flags, -1, 0);
+        if (raw == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        const uintptr_t start = ((uintptr_t)raw + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+        char *aligned = (char *)start;
+        if (aligned != raw) {
+            munmap(raw, aligned - raw);
+        }
+        munmap(aligned + bytes, raw + mapped - (aligned + bytes));
+
+        /* Advise before the first touch, so faults map whole huge pages */
+        madvise(aligned, bytes, MADV_HUGEPAGE);
+        if (this->populate) {
+            madvise(aligned, bytes, MADV_WILLNEED);
+        }
+        return aligned;
+    }
+
+    /* Pages are aligned to memory pages, so that layout can rely on it */
+    Entry *alloc_page() {
+        const size_t bytes = this->page_bytes();
+        void *mem;
+        if (this->backing == Backing::HUGEPAGE) {
+            mem = this->map_huge(bytes);
+        } else {
+            mem = std::aligned_alloc(MEM_PAGE, bytes);
+            if (mem == NULL) {
+                throw std::bad_alloc();
+            }
+        }
+
+        /* Constructing entries faults in the whole page */
+        Entry *page = static_cast<Entry *>(mem);
+        for (int i = 0; i < PAGE_SIZE; i++) {
+            new (&page[i]) Entry();
+        }
+
+        if (this->lock and mlock(mem, bytes) != 0) {
+            this->free_page(page);
+            throw std::runtime_error("Unable to mlock Flat page");
+        }
+        return page;
+    }
+
+    void free_page(Entry *page) {
+        const size_t bytes = this->page_bytes();
+        if (this->lock) {
+            munlock(page, bytes);
+        }
+        if (this->backing == Backing::HUGEPAGE) {
+            munmap(page, bytes);
+        } else {
+            std::free(page);
+        }
+    }
+
     Entry *alloc_entry() {
         /* Allocate new page if required */
         if (used_in_page == PAGE_SIZE or page_current == NULL) {
-            this->page_current = new Entry[PAGE_SIZE];
+            this->page_current = this->alloc_page();
             this->pages.push_back(this->page_current);
             used_in_page = 0;
         }
@@ -66,7 +221,7 @@ protected:
         return entry;
     }
 
-    Entry *build_node(typename Tritrie<BITS>::Node *node) {
+    Entry *build_node(typename Tritrie<BITS, K, V, def>::Node *node) {
         if (node == NULL) {
             /* Reached the end of the path */
             return NULL;
@@ -81,11 +236,328 @@ protected:
         return entry;
     }
 
+    /* Call fn(i) for each i in [0, count) on up to threads threads */
+    template<typename Fn>
+    static void run_parallel(int threads, size_t count, Fn fn) {
+        threads = std::max(1, std::min<int>(threads, count));
+        std::atomic<size_t> next(0);
+        std::vector<std::exception_ptr> errors(threads);
+        auto work = [&next, &errors, &fn, count] (int thread) {
+            try {
+                for (size_t i = next++; i < count; i = next++) {
+                    fn(i);
+                }
+            } catch (...) {
+                errors[thread] = std::current_exception();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int thread = 1; thread < threads; thread++) {
+            workers.emplace_back(work, thread);
+        }
+        work(0);
+        for (auto &worker: workers) {
+            worker.join();
+        }
+        for (auto &error: errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+    /*
+     * Allocate pages for the given number of entries up front and mark
+     * them all used; entries are handed out by arenas.
+     */
+    void reserve(size_t entries, int threads) {
+        const size_t count = (entries + PAGE_SIZE - 1) / PAGE_SIZE;
+        this->pages.assign(count, NULL);
+        try {
+            /* Constructing entries faults the pages in - share the work */
+            run_parallel(threads, count, [this] (size_t page) {
+                this->pages[page] = this->alloc_page();
+            });
+        } catch (...) {
+            this->pages.erase(std::remove(this->pages.begin(), this->pages.end(),
+                                          (Entry *)NULL),
+                              this->pages.end());
+            throw;
+        }
+        this->page_current = count > 0 ? this->pages.back() : NULL;
+        this->used_total = entries;
+        this->used_in_page = entries - (count - 1) * PAGE_SIZE;
+    }
+
+    /* Range of reserved entries, allocated in order by a single thread */
+    struct Arena {
+        size_t next;
+        size_t end;
+    };
+
+    Entry *alloc_entry(Arena &arena) {
+        /* Entry counts are exact */
+        assert(arena.next < arena.end);
+        const size_t index = arena.next++;
+        return &this->pages[index / PAGE_SIZE][index % PAGE_SIZE];
+    }
+
+    /* Child slot of a level given at runtime; same as chunk<L> */
+    static int slot_of(K ip, int level) {
+        const int shift = BITS_TOTAL - (level + 1) * BITS;
+        if (shift >= 0) {
+            return (int)(ip >> shift) & (CHILDREN - 1);
+        }
+        return (int)(ip << -shift) & (CHILDREN - 1);
+    }
+
+    /*
+     * Call fn(level, first, span) for the child slots a prefix goes
+     * through: a single one on each full level, and the whole expansion
+     * of a shorter last level. Prefix has no bits set past its length.
+     */
+    template<typename Fn>
+    static void each_slot(const Prefix<K, V> &prefix, Fn fn) {
+        const int full = prefix.len / BITS;
+        for (int level = 0; level < full; level++) {
+            fn(level, slot_of(prefix.ip, level), 1);
+        }
+        const int rest = prefix.len % BITS;
+        if (rest != 0) {
+            fn(full, slot_of(prefix.ip, full), 1 << (BITS - rest));
+        }
+    }
+
+    /*
+     * Number of entries the prefixes, in address order, create below the
+     * root child they all share. In that order the slots each level gets
+     * are never decreasing, so a sweep counts shared paths and overlapping
+     * expansions once.
+     */
+    static size_t count_entries(const Prefix<K, V> *begin,
+                                const Prefix<K, V> *end) {
+        struct Sweep {
+            /* Bits above the level, so parent entry */
+            K parent = 0;
+            /* First slot of the parent not counted yet */
+            int next = 0;
+        };
+        std::vector<Sweep> sweeps(LEVELS);
+
+        size_t total = 0;
+        for (auto *prefix = begin; prefix != end; prefix++) {
+            each_slot(*prefix, [&] (int level, int first, int span) {
+                if (level == 0) {
+                    return;
+                }
+                Sweep &sweep = sweeps[level];
+                const K parent = prefix->ip >> (BITS_TOTAL - level * BITS);
+                if (parent != sweep.parent) {
+                    sweep.parent = parent;
+                    sweep.next = 0;
+                }
+                const int start = std::max(first, sweep.next);
+                if (first + span > start) {
+                    total += first + span - start;
+                    sweep.next = first + span;
+                }
+            });
+        }
+        return total;
+    }
+
+    /*
+     * Set a value of a prefix, creating entries on the way. Prefixes are
+     * inserted in address order, which puts each network before the ones
+     * it covers - so a value can simply overwrite the previous one.
+     */
+    void insert(const Prefix<K, V> &prefix, Arena &arena) {
+        Entry *cur = &this->pages[0][0];
+        if (prefix.len == 0) {
+            cur->value = prefix.value;
+            return;
+        }
+        each_slot(prefix, [&] (int level, int first, int span) {
+            Entry *parent = cur;
+            for (int i = first; i < first + span; i++) {
+                if (parent->child[i] == NULL) {
+                    parent->child[i] = this->alloc_entry(arena);
+                }
+                cur = parent->child[i];
+            }
+            if (level * BITS + BITS >= prefix.len) {
+                /* Last level */
+                for (int i = first; i < first + span; i++) {
+                    parent->child[i]->value = prefix.value;
+                }
+            }
+        });
+    }
+
+    /* Place an entry for a pending node and queue its children */
+    template<typename Queue>
+    void place(const Pending &pending, Queue &queue) {
+        Entry *entry = this->alloc_entry();
+        entry->value = pending.node->value;
+        *pending.slot = entry;
+
+        for (int i = 0; i < CHILDREN; i++) {
+            if (pending.node->child[i] == NULL) {
+                entry->child[i] = NULL;
+            } else {
+                queue.push_back({pending.node->child[i], &entry->child[i]});
+            }
+        }
+    }
+
+    void build_bfs(typename Tritrie<BITS, K, V, def>::Node *root) {
+        Entry *root_entry;
+        std::deque<Pending> queue = {{root, &root_entry}};
+        while (!queue.empty()) {
+            this->place(queue.front(), queue);
+            queue.pop_front();
+        }
+    }
+
+    /* Number of entries which will still start within current memory page */
+    size_t left_in_mem_page() const {
+        if (this->page_current == NULL or this->used_in_page == PAGE_SIZE) {
+            return std::min<size_t>(PAGE_SIZE,
+                                    (MEM_PAGE + sizeof(Entry) - 1) / sizeof(Entry));
+        }
+        const size_t offset = this->used_in_page * sizeof(Entry);
+        const size_t end = (offset / MEM_PAGE + 1) * MEM_PAGE;
+        const size_t left = (end - offset + sizeof(Entry) - 1) / sizeof(Entry);
+        return std::min<size_t>(PAGE_SIZE - this->used_in_page, left);
+    }
+
+    /*
+     * Fill each memory page with a breadth-first walk of a subtree. When a
+     * page fills up the rest of the walk frontier becomes new subtree roots,
+     * placed right after it; when a subtree ends early the next one shares
+     * its memory page.
+     */
+    void build_paged(typename Tritrie<BITS, K, V, def>::Node *root) {
+        Entry *root_entry;
+        std::deque<Pending> roots = {{root, &root_entry}};
+        std::deque<Pending> cluster;
+
+        while (!roots.empty()) {
+            cluster.push_back(roots.front());
+            roots.pop_front();
+
+            size_t budget = this->left_in_mem_page();
+            while (!cluster.empty() and budget > 0) {
+                this->place(cluster.front(), cluster);
+                cluster.pop_front();
+                budget--;
+            }
+
+            /* Memory page is full - spill the frontier */
+            roots.insert(roots.begin(), cluster.begin(), cluster.end());
+            cluster.clear();
+        }
+    }
+
+    /*
+     * Child slot of a level, taken straight from the key. Bits of a short
+     * last level are aligned to the top of the slot number, like Tritrie
+     * does with its shifted key.
+     */
+    template<int L>
+    static int chunk(K ip) {
+        constexpr int shift = BITS_TOTAL - (L + 1) * BITS;
+        if constexpr (shift >= 0) {
+            return (int)(ip >> shift) & (CHILDREN - 1);
+        } else {
+            return (int)(ip << -shift) & (CHILDREN - 1);
+        }
+    }
+
+    /* Same, from 64-bit halves of an IPv6 key */
+    template<int L>
+    static int chunk(const Halves &ip) {
+        constexpr int start = L * BITS;
+        constexpr int end = start + BITS < BITS_TOTAL ? start + BITS : BITS_TOTAL;
+        constexpr int width = end - start;
+        constexpr uint64_t mask = (1u << width) - 1;
+
+        uint64_t bits;
+        if constexpr (end <= 64) {
+            bits = ip.high >> (64 - end);
+        } else if constexpr (start >= 64) {
+            bits = ip.low >> (128 - end);
+        } else {
+            /* Level spans both halves */
+            bits = (ip.high << (end - 64)) | (ip.low >> (128 - end));
+        }
+        return (int)(bits & mask) << (BITS - width);
+    }
+
+    /* Same, from a network-order address */
+    template<int L>
+    static int chunk(const uint8_t *addr) {
+        return byte_chunk<BITS, BITS_TOTAL, L>(addr);
+    }
+
+    /* Descend a single level; false when there's nowhere to run */
+    template<typename Fn>
+    static bool step(int slot, const Entry *&cur, V &matched, Fn &visit) {
+        const Entry *child = cur->child[slot];
+        if (child == NULL) {
+            return false;
+        }
+        cur = child;
+        visit(cur);
+        if (cur->value != def) {
+            matched = cur->value;
+        }
+        return true;
+    }
+
+    /* Key is either K or a pointer to network-order bytes */
+    template<typename Key, typename Fn, size_t... L>
+    V walk_unrolled(Key key, Fn &visit, std::index_sequence<L...>) const {
+        const Entry *cur = &this->pages[0][0];
+        visit(cur);
+
+        V matched = cur->value;
+        /* Stops on the first level without a child */
+        (void)(step(chunk<L>(key), cur, matched, visit) && ...);
+        return matched;
+    }
+
+    /*
+     * Walk the table for an IP calling visit on each reached entry.
+     * Shared by query and profile recording. Levels are unrolled at compile
+     * time, so there's no loop-carried shift of the key.
+     */
+    template<int N = LEVELS, typename Key, typename Fn>
+    V walk(Key key, Fn visit) const {
+        /* Querying uninitialized structure will fail */
+        assert(this->used_total > 0);
+        return this->walk_unrolled(key, visit, std::make_index_sequence<N>());
+    }
+
+    /* Call fn for each used entry in the placement order */
+    template<typename Fn>
+    void each_entry(Fn fn) const {
+        for (size_t p = 0; p < this->pages.size(); p++) {
+            const int used = (p + 1 == this->pages.size()
+                              ? this->used_in_page : PAGE_SIZE);
+            for (int i = 0; i < used; i++) {
+                fn(&this->pages[p][i]);
+            }
+        }
+    }
+
     void cleanup() {
         for (auto *page: this->pages) {
-            delete[] page;
+            this->free_page(page);
         }
         this->pages.clear();
+        this->pages_hugetlb = 0;
         this->used_in_page = 0;
         this->used_total = 0;
         this->page_current = NULL;
@@ -94,54 +566,377 @@ protected:
     /* Don't copy. */
     Flat(const Flat &flatritrie);
 
+    template<int B, typename TV, TV tdef> friend class Hash48;
+    template<int B, typename TV, TV tdef> friend class DualStack;
+
 public:
+    /* Number of recorded lookups which passed through each entry */
+    using Profile = std::unordered_map<const Entry *, uint64_t>;
+
     Flat() {}
 
+    /**
+     * Flat with pages backed according to a policy. With populate the
+     * memory is faulted in when mapped; with lock it can't be swapped out.
+     */
+    explicit Flat(Backing backing, bool populate = false, bool lock = false)
+        : backing(backing), populate(populate), lock(lock) {}
+
     ~Flat() {
         this->cleanup();
     }
 
-    void build(Tritrie<BITS> &trie) {
+    void build(Tritrie<BITS, K, V, def> &trie, Layout layout = Layout::DFS) {
         this->cleanup();
-        this->build_node(&trie.root);
+        this->high_only = trie.longest_mask() <= 64;
+        switch (layout) {
+        case Layout::DFS:
+            this->build_node(&trie.root);
+            break;
+        case Layout::BFS:
+            this->build_bfs(&trie.root);
+            break;
+        case Layout::PAGE:
+            this->build_paged(&trie.root);
+            break;
+        }
     }
 
-    V query_string(const std::string &addr) const {
-        in_addr ip_parsed;
-        int ret = inet_aton(addr.c_str(), &ip_parsed);
-        if (ret == 0)
-            throw std::exception();
+    /**
+     * Build straight from count numeric prefixes, without a Tritrie.
+     * Prefixes can come in any order; of equal networks the last one wins,
+     * as with Tritrie::add.
+     *
+     * Subtrees of root children are independent. Entries of each are
+     * counted exactly, given a continuous range of pages allocated up front
+     * and filled in the address order (close to Layout::DFS) by one of the
+     * threads. Networks shorter than the first level are expanded within
+     * the root beforehand.
+     */
+    void build(const Prefix<K, V> *prefixes, size_t count, int threads = 1) {
+        this->cleanup();
 
-        uint32_t ip_network = ntohl(ip_parsed.s_addr);
-        return this->query(ip_network);
+        std::vector<Prefix<K, V>> sorted(prefixes, prefixes + count);
+        int longest = 0;
+        for (auto &prefix: sorted) {
+            if (prefix.len > BITS_TOTAL) {
+                throw std::runtime_error("Prefix longer than the address");
+            }
+            /* Host bits would break the address order */
+            prefix.ip = (prefix.len == 0 ? 0
+                         : prefix.ip & (~(K)0 << (BITS_TOTAL - prefix.len)));
+            longest = std::max<int>(longest, prefix.len);
+        }
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [] (const Prefix<K, V> &a, const Prefix<K, V> &b) {
+                             return a.ip < b.ip or (a.ip == b.ip and a.len < b.len);
+                         });
+        this->high_only = longest <= 64;
+
+        /* Split the short networks off; the rest is grouped by root slot */
+        std::vector<Prefix<K, V>> top;
+        const auto split = std::stable_partition(
+            sorted.begin(), sorted.end(),
+            [] (const Prefix<K, V> &prefix) { return prefix.len < BITS; });
+        top.assign(sorted.begin(), split);
+        sorted.erase(sorted.begin(), split);
+
+        std::vector<size_t> bounds(CHILDREN + 1, sorted.size());
+        for (size_t i = sorted.size(); i > 0; i--) {
+            bounds[slot_of(sorted[i - 1].ip, 0)] = i - 1;
+        }
+        for (int slot = CHILDREN - 1; slot >= 0; slot--) {
+            bounds[slot] = std::min(bounds[slot], bounds[slot + 1]);
+        }
+
+        /* Root and its children come first */
+        std::vector<bool> used(CHILDREN, false);
+        for (auto &prefix: top) {
+            each_slot(prefix, [&used] (int, int first, int span) {
+                std::fill(used.begin() + first, used.begin() + first + span, true);
+            });
+        }
+        for (int slot = 0; slot < CHILDREN; slot++) {
+            used[slot] = used[slot] or bounds[slot] < bounds[slot + 1];
+        }
+        std::vector<Arena> arenas(CHILDREN + 1);
+        arenas[0] = {0, 1 + (size_t)std::count(used.begin(), used.end(), true)};
+
+        const Prefix<K, V> *data = sorted.data();
+        run_parallel(threads, CHILDREN, [&] (size_t slot) {
+            const size_t entries = count_entries(data + bounds[slot],
+                                                 data + bounds[slot + 1]);
+            arenas[slot + 1] = {0, entries};
+        });
+        for (int slot = 0; slot < CHILDREN; slot++) {
+            arenas[slot + 1].next = arenas[slot].end;
+            arenas[slot + 1].end += arenas[slot + 1].next;
+        }
+        this->reserve(arenas[CHILDREN].end, threads);
+
+        Entry *root = this->alloc_entry(arenas[0]);
+        for (auto &prefix: top) {
+            this->insert(prefix, arenas[0]);
+        }
+        for (int slot = 0; slot < CHILDREN; slot++) {
+            if (used[slot] and root->child[slot] == NULL) {
+                root->child[slot] = this->alloc_entry(arenas[0]);
+            }
+        }
+
+        /* Threads only read the root and write within their subtrees */
+        run_parallel(threads, CHILDREN, [&] (size_t slot) {
+            for (size_t i = bounds[slot]; i < bounds[slot + 1]; i++) {
+                this->insert(sorted[i], arenas[slot + 1]);
+            }
+        });
+    }
+
+    V query_string(const std::string &addr) const {
+        K ip;
+        int mask;
+        parse_ip<K>(addr, ip, mask);
+        if (mask != -1 && mask != BITS_TOTAL) {
+            throw std::runtime_error("Query with partial mask.");
+        }
+        return this->query(ip);
     }
 
     V query(K ip) const {
+        if constexpr (BITS_TOTAL == 128) {
+            /* 64-bit operations instead of 128-bit shifts */
+            const uint64_t high = ip >> 64;
+            if (this->high_only) {
+                /*
+                 * Deeper levels don't exist and level crossing /64 holds
+                 * the same value for any low bits - it's an expansion.
+                 */
+                return this->template walk<LEVELS_HIGH>(Halves{high, 0},
+                                                        [] (const Entry *) {});
+            }
+            return this->walk(Halves{high, (uint64_t)ip}, [] (const Entry *) {});
+        } else {
+            return this->walk(ip, [] (const Entry *) {});
+        }
+    }
+
+    /**
+     * Query by a network-order address (4 or 16 bytes, depending on K), as
+     * it is in the IP header. Levels read their bits from the bytes
+     * directly, so there's no byte swap nor key assembly.
+     */
+    V query_bytes(const uint8_t *addr) const {
+        return this->walk(addr, [] (const Entry *) {});
+    }
+
+    /**
+     * Query a burst of addresses given by pointers into packet headers,
+     * storing results in out[0..n). First level entry of a lookup a few
+     * places ahead is prefetched while the current one is walked.
+     */
+    void query_bytes_burst(const uint8_t *const *addrs, V *out, size_t n) const {
         /* Querying uninitialized structure will fail */
         assert(this->used_total > 0);
 
-        const Entry *cur = &this->pages[0][0];
+        constexpr size_t AHEAD = 4;
+        const Entry *root = &this->pages[0][0];
+        for (size_t i = 0; i < n; i++) {
+            if (i + AHEAD < n) {
+                const Entry *first = root->child[chunk<0>(addrs[i + AHEAD])];
+                if (first != NULL) {
+                    __builtin_prefetch(first);
+                }
+            }
+            out[i] = this->query_bytes(addrs[i]);
+        }
+    }
 
-        V matched = def;
-        for (;;) {
-            const int tri = ip >> BITS_COMPLEMENT;
-            const auto *child = cur->child[tri];
+    /**
+     * Query and count entries visited on the way in the profile. Profile
+     * refers to the current placement; relayout() invalidates it.
+     */
+    V record(K ip, Profile &profile) const {
+        return this->walk(ip, [&profile] (const Entry *entry) {
+            profile[entry] += 1;
+        });
+    }
 
-            if (child == NULL) {
-                /* Nowhere to run */
-                return matched;
+    /**
+     * Reorder entries by the number of lookups in profile which passed
+     * through them. Hot paths get packed at the beginning of the table so
+     * they can stay resident in caches; unvisited entries keep their order
+     * in the tail.
+     */
+    void relayout(const Profile &profile) {
+        /* Querying uninitialized structure will fail */
+        assert(this->used_total > 0);
+
+        std::vector<const Entry *> order;
+        order.reserve(this->used_total);
+        this->each_entry([&order] (const Entry *entry) {
+            order.push_back(entry);
+        });
+
+        auto hits = [&profile] (const Entry *entry) -> uint64_t {
+            auto found = profile.find(entry);
+            return found == profile.end() ? 0 : found->second;
+        };
+        /* Root stays first; parent is never colder than its children */
+        std::stable_sort(order.begin() + 1, order.end(),
+                         [&hits] (const Entry *a, const Entry *b) {
+                             return hits(a) > hits(b);
+                         });
+
+        /* Copy into fresh pages in the new order */
+        std::vector<Entry *> old_pages;
+        std::swap(old_pages, this->pages);
+        this->pages_hugetlb = 0;
+        this->page_current = NULL;
+        this->used_in_page = 0;
+        this->used_total = 0;
+
+        std::unordered_map<const Entry *, Entry *> moved;
+        moved.reserve(order.size());
+        for (const Entry *entry: order) {
+            Entry *copy = this->alloc_entry();
+            *copy = *entry;
+            moved[entry] = copy;
+        }
+
+        for (const Entry *entry: order) {
+            Entry *copy = moved.at(entry);
+            for (int i = 0; i < CHILDREN; i++) {
+                if (copy->child[i] != NULL) {
+                    copy->child[i] = moved.at(copy->child[i]);
+                }
             }
-            cur = child;
-            if (cur->value != def) {
-                matched = cur->value;
+        }
+
+        for (auto *page: old_pages) {
+            this->free_page(page);
+        }
+    }
+
+    /**
+     * Query a burst of addresses at once, storing results in out[0..n).
+     *
+     * Up to BATCH lookups are walked in lockstep. Each lookup prefetches the
+     * slot of its next Entry and yields to the others before reading it, so
+     * the memory latency of independent lookups overlaps instead of stalling
+     * the core on every level. Finished lanes are refilled from the burst.
+     */
+    void query_batch(const K *ips, V *out, size_t n) const {
+        /* Querying uninitialized structure will fail */
+        assert(this->used_total > 0);
+
+        const Entry *root = &this->pages[0][0];
+
+        struct Lane {
+            const Entry *cur;
+            K ip;
+            V matched;
+            size_t pos;
+        } lanes[BATCH];
+
+        size_t next = 0;
+        int active = 0;
+        for (; active < BATCH && next < n; active++, next++) {
+            lanes[active] = {root, ips[next], def, next};
+        }
+
+        while (active > 0) {
+            for (int i = 0; i < active;) {
+                Lane &lane = lanes[i];
+
+                /* Entry was prefetched during the previous round */
+                if (lane.cur->value != def) {
+                    lane.matched = lane.cur->value;
+                }
+
+                const Entry *child = lane.cur->child[lane.ip >> BITS_COMPLEMENT];
+                if (child == NULL) {
+                    /* Nowhere to run - retire the lane or refill it */
+                    out[lane.pos] = lane.matched;
+                    if (next < n) {
+                        lane = {root, ips[next], def, next};
+                        next++;
+                        i++;
+                    } else {
+                        lane = lanes[--active];
+                    }
+                    continue;
+                }
+
+                lane.ip <<= BITS;
+                __builtin_prefetch(&child->value);
+                __builtin_prefetch(&child->child[lane.ip >> BITS_COMPLEMENT]);
+                lane.cur = child;
+                i++;
+            }
+        }
+    }
+
+    /**
+     * Write a position independent image of the table, with pointers
+     * replaced by entry indices. Query it with FlatImage::open_mmap.
+     */
+    void save(const std::string &path) const {
+        /* Querying uninitialized structure will fail */
+        assert(this->used_total > 0);
+
+        /* Entries are numbered in their placement order; root is 0 */
+        std::vector<std::pair<const Entry *, uint32_t>> bases;
+        for (size_t p = 0; p < this->pages.size(); p++) {
+            bases.push_back({this->pages[p], p * PAGE_SIZE});
+        }
+        std::sort(bases.begin(), bases.end());
+        auto index = [&bases] (const Entry *entry) -> uint32_t {
+            auto page = std::upper_bound(
+                bases.begin(), bases.end(), entry,
+                [] (const Entry *e, const auto &base) { return e < base.first; });
+            --page;
+            return page->second + (entry - page->first);
+        };
+
+        std::vector<V> values;
+        values.reserve(this->used_total);
+        this->each_entry([&values] (const Entry *entry) {
+            values.push_back(entry->value);
+        });
+
+        ImageWriter<BITS, K, V, def> writer(path, values.size());
+        uint32_t row[CHILDREN];
+        this->each_entry([&] (const Entry *entry) {
+            for (int i = 0; i < CHILDREN; i++) {
+                row[i] = entry->child[i] == NULL ? 0 : index(entry->child[i]);
+            }
+            writer.write_row(row);
+        });
+        writer.finish(values);
+    }
+
+    /**
+     * Read a byte of every memory page of the table, so that the first
+     * queries after a build or a long pause don't take page or TLB misses.
+     */
+    void warm() const {
+        const size_t bytes = PAGE_SIZE * sizeof(Entry);
+        volatile char sink = 0;
+        for (const Entry *page: this->pages) {
+            const char *mem = (const char *)page;
+            for (size_t offset = 0; offset < bytes; offset += MEM_PAGE) {
+                sink = sink + mem[offset];
             }
-            ip <<= BITS;
         }
-        return matched;
     }
 
     int size() const {
-        return this->used;
+        return this->used_total;
+    }
+
+    /* Bytes used by allocated pages */
+    size_t memory() const {
+        return this->pages.size() * this->page_bytes();
     }
 
     void debug() {
@@ -150,6 +945,13 @@ public:
                   << " of size " << PAGE_SIZE << std::endl
                   << "  entries total = " << this->used_total
                   << " on last page = " << this->used_in_page
+                  << " of " << sizeof(Entry) << "B" << std::endl
+                  << "  backing = "
+                  << (this->backing == Backing::HUGEPAGE ? "huge" : "heap")
+                  << (this->populate ? " populated" : "")
+                  << (this->lock ? " locked" : "")
+                  << "; hugetlb pages = " << this->pages_hugetlb << std::endl
+                  << "  memory = " << this->memory() / 1024 << "kB"
                   << std::endl;
     }
 };
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _FLATSKIP_H_
+#define _FLATSKIP_H_
+
+#include <limits>
+#include <vector>
+#include <tritrie.hpp>
+
+namespace Tritrie {
+
+/*
+ * Flatritrie variant with multibit path compression.
+ *
+ * Chains of Tritrie nodes without a value and with a single child are
+ * collapsed into the entry which ends them, like FlaTrie does for the 1-bit
+ * trie. Such entry stores the number of skipped levels and their key bits
+ * aligned to the top of K; reaching it costs a single XOR and shift to
+ * compare all of them at once. A mismatch ends the query - skipped levels had
+ * no values and no other way through.
+ *
+ * Pays off for sparse tables, like IPv6 with long prefixes, where most of
+ * Flat<8> entries have exactly one child.
+ */
+template<int BITS=8, typename K=uint32_t, typename V=int32_t, V def=-1>
+class FlatSkip {
+protected:
+    constexpr static int BITS_TOTAL = std::numeric_limits<K>::digits;
+    constexpr static int CHILDREN = (1<<BITS);
+    constexpr static int BITS_COMPLEMENT = (BITS_TOTAL - BITS);
+
+    using Node = typename Tritrie<BITS, K, V, def>::Node;
+
+    struct Entry {
+        /* Key bits of the skipped levels, aligned to the top */
+        K bits = 0;
+        /* Number of skipped levels */
+        uint8_t skip = 0;
+        V value = def;
+
+        /* Entry indices, 0 means no child - root is nobody's child */
+        uint32_t child[CHILDREN] = {};
+    };
+
+    std::vector<Entry> entries;
+
+    /* Levels collapsed in total */
+    int skipped = 0;
+
+    uint32_t alloc_entry() {
+        const size_t idx = this->entries.size();
+        if (idx > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("FlatSkip entry table overflow");
+        }
+        this->entries.emplace_back();
+        return idx;
+    }
+
+    /* The only child of a node, -1 if there are none or more */
+    static int only_child(const Node *node) {
+        int only = -1;
+        for (int i = 0; i < CHILDREN; i++) {
+            if (node->child[i] != NULL) {
+                if (only != -1) {
+                    return -1;
+                }
+                only = i;
+            }
+        }
+        return only;
+    }
+
+    uint32_t build_node(const Node *node, bool compress) {
+        K bits = 0;
+        int skip = 0;
+        while (compress and node->value == def) {
+            const int only = only_child(node);
+            if (only == -1) {
+                break;
+            }
+            bits = (bits << BITS) | only;
+            node = node->child[only];
+            skip++;
+        }
+
+        const uint32_t idx = this->alloc_entry();
+        Entry &entry = this->entries[idx];
+        entry.value = node->value;
+        entry.skip = skip;
+        entry.bits = skip > 0 ? bits << (BITS_TOTAL - skip * BITS) : 0;
+        this->skipped += skip;
+
+        for (int i = 0; i < CHILDREN; i++) {
+            if (node->child[i] != NULL) {
+                /* Table might get reallocated during the recursion */
+                const uint32_t child = this->build_node(node->child[i], true);
+                this->entries[idx].child[i] = child;
+            }
+        }
+        return idx;
+    }
+
+    /* Don't copy. */
+    FlatSkip(const FlatSkip &flatskip);
+
+public:
+    FlatSkip() {}
+
+    void build(Tritrie<BITS, K, V, def> &trie) {
+        this->entries.clear();
+        this->skipped = 0;
+        /* Chains are never deeper than the key */
+        static_assert((BITS_TOTAL + BITS - 1) / BITS
+                      <= std::numeric_limits<uint8_t>::max(), "Skip overflow");
+        this->build_node(&trie.root, false);
+        this->entries.shrink_to_fit();
+    }
+
+    V query_string(const std::string &addr) const {
+        K ip;
+        int mask;
+        parse_ip<K>(addr, ip, mask);
+        if (mask != -1 && mask != BITS_TOTAL) {
+            throw std::runtime_error("Query with partial mask.");
+        }
+        return this->query(ip);
+    }
+
+    V query(K ip) const {
+        /* Querying uninitialized structure will fail */
+        assert(this->entries.size() > 0);
+
+        const Entry *table = this->entries.data();
+        const Entry *cur = &table[0];
+        V matched = cur->value;
+        for (;;) {
+            const uint32_t child = cur->child[ip >> BITS_COMPLEMENT];
+            if (child == 0) {
+                /* Nowhere to run */
+                return matched;
+            }
+            cur = &table[child];
+            ip <<= BITS;
+
+            if (cur->skip) {
+                /* At least one level was read, so shifts stay in range */
+                const int skip_bits = cur->skip * BITS;
+                if ((ip ^ cur->bits) >> (BITS_TOTAL - skip_bits)) {
+                    return matched;
+                }
+                ip <<= skip_bits;
+            }
+
+            if (cur->value != def) {
+                matched = cur->value;
+            }
+        }
+        return matched;
+    }
+
+    /* Number of entries visited by a query */
+    int depth(K ip) const {
+        const Entry *cur = &this->entries[0];
+        int visited = 1;
+        while (uint32_t child = cur->child[ip >> BITS_COMPLEMENT]) {
+            cur = &this->entries[child];
+            ip <<= BITS;
+            visited++;
+            if (cur->skip) {
+                const int skip_bits = cur->skip * BITS;
+                if ((ip ^ cur->bits) >> (BITS_TOTAL - skip_bits)) {
+                    break;
+                }
+                ip <<= skip_bits;
+            }
+        }
+        return visited;
+    }
+
+    int size() const {
+        return this->entries.size();
+    }
+
+    /* Bytes used by the entry table */
+    size_t memory() const {
+        return this->entries.capacity() * sizeof(Entry);
+    }
+
+    void debug() {
+        std::cout << "FlatSkip debug stats:" << std::endl
+                  << "  entries total = " << this->entries.size()
+                  << " of " << sizeof(Entry) << "B" << std::endl
+                  << "  levels skipped = " << this->skipped << std::endl
+                  << "  memory = " << this->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+};
+#endif
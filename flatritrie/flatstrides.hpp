@@ -0,0 +1,324 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _FLATSTRIDES_H_
+#define _FLATSTRIDES_H_
+
+#include <array>
+#include <limits>
+#include <vector>
+#include <utility>
+#include <type_traits>
+#include <tritrie.hpp>
+
+namespace Tritrie {
+
+/*
+ * Level tables of a Flatritrie with a different number of bits matched at
+ * each level; strides are given at runtime.
+ *
+ * Each level has its own table of nodes. Node of a level with stride S is
+ * a run of 2^S slots; a slot holds a value of the longest prefix ending on
+ * this level and an index of a node on the next one. Like Tritrie it's
+ * filled directly from prefixes sorted by mask.
+ */
+template<typename K, typename V, V def>
+class FlatStridesBase {
+protected:
+    constexpr static int BITS_TOTAL = std::numeric_limits<K>::digits;
+
+    struct Slot {
+        /* Node index on the next level + 1; 0 if there's no child */
+        uint32_t child = 0;
+        /* VALUE if reached this place */
+        V value = def;
+    };
+
+    const std::vector<int> strides;
+    /* Right shift which brings bits of a level to the bottom */
+    const std::vector<int> shifts;
+
+    std::vector<std::vector<Slot>> levels;
+
+    /* Value of the /0 entry */
+    V root_value = def;
+
+    /* Mask during insertion can only grow or stay the same */
+    int last_mask = 0;
+
+    static std::vector<int> compute_shifts(const std::vector<int> &strides) {
+        std::vector<int> shifts;
+        int consumed = 0;
+        for (int stride: strides) {
+            if (stride <= 0 or stride > 24) {
+                throw std::runtime_error("Each stride must be within 1 to 24 bits");
+            }
+            consumed += stride;
+            shifts.push_back(BITS_TOTAL - consumed);
+        }
+        if (consumed != BITS_TOTAL) {
+            throw std::runtime_error("Strides must cover the whole address");
+        }
+        return shifts;
+    }
+
+    /* Allocate a node on a level and return its index */
+    uint32_t alloc_node(int level) {
+        auto &table = this->levels[level];
+        const size_t idx = table.size() >> this->strides[level];
+        if (idx >= std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("FlatStrides level overflow");
+        }
+        table.resize(table.size() + ((size_t)1 << this->strides[level]));
+        return idx;
+    }
+
+    void add_ip(K ip, int mask, V value) {
+        if (mask < this->last_mask) {
+            std::cerr << "Inserting mask " << mask
+                      << " after mask " << this->last_mask << std::endl;
+            throw std::runtime_error("Invalid order of IP insertion to FlatStrides");
+        }
+        this->last_mask = mask;
+
+        if (mask == 0) {
+            this->root_value = value;
+            return;
+        }
+
+        uint32_t node = 0;
+        int consumed = 0;
+        for (size_t l = 0; l < this->strides.size(); l++) {
+            const int stride = this->strides[l];
+            const uint32_t bits = (uint32_t)(ip >> this->shifts[l]) & ((1u << stride) - 1);
+            const size_t base = (size_t)node << stride;
+            const int mask_left = mask - consumed;
+
+            if (mask_left <= stride) {
+                /* Mask ends on this level; expand over matching slots */
+                const uint32_t span = 1u << (stride - mask_left);
+                const uint32_t first = bits & ~(span - 1);
+                for (uint32_t i = 0; i < span; i++) {
+                    this->levels[l][base + first + i].value = value;
+                }
+                return;
+            }
+
+            if (this->levels[l][base + bits].child == 0) {
+                const uint32_t child = this->alloc_node(l + 1);
+                this->levels[l][base + bits].child = child + 1;
+            }
+            node = this->levels[l][base + bits].child - 1;
+            consumed += stride;
+        }
+    }
+
+    explicit FlatStridesBase(const std::vector<int> &strides)
+        : strides(strides), shifts(compute_shifts(strides)),
+          levels(strides.size()) {
+        this->alloc_node(0);
+    }
+
+    /* Don't copy. */
+    FlatStridesBase(const FlatStridesBase &flat);
+
+public:
+    /* Bytes of a single slot; memory of a level is nodes * 2^stride slots */
+    constexpr static size_t SLOT_BYTES = sizeof(Slot);
+
+    void add(const std::string addr_mask, V value) {
+        K ip;
+        int mask;
+        parse_ip<K>(addr_mask, ip, mask);
+        if (mask == -1) {
+            throw std::runtime_error("Address without a mask");
+        }
+        if (mask < 0 || mask > BITS_TOTAL)
+            throw std::runtime_error("Invalid mask");
+        this->add_ip(ip, mask, value);
+    }
+
+    /**
+     * Reserve level tables for node counts by depth, as computed by
+     * StrideOptimizer::nodes(), so that adding the same prefixes doesn't
+     * leave growth slack and memory() matches the optimizer cost.
+     */
+    void reserve(const std::vector<size_t> &nodes) {
+        int depth = 0;
+        for (size_t l = 0; l < this->strides.size(); l++) {
+            this->levels[l].reserve(nodes.at(depth) << this->strides[l]);
+            depth += this->strides[l];
+        }
+    }
+
+    /* Nodes on all levels */
+    int size() const {
+        int nodes = 0;
+        for (size_t l = 0; l < this->strides.size(); l++) {
+            nodes += this->levels[l].size() >> this->strides[l];
+        }
+        return nodes;
+    }
+
+    /* Bytes used by level tables */
+    size_t memory() const {
+        size_t bytes = 0;
+        for (auto &table: this->levels) {
+            bytes += table.capacity() * sizeof(Slot);
+        }
+        return bytes;
+    }
+
+    void debug() {
+        std::cout << "FlatStrides debug stats:" << std::endl;
+        for (size_t l = 0; l < this->strides.size(); l++) {
+            std::cout << "  level " << l << " stride " << this->strides[l]
+                      << " nodes = " << (this->levels[l].size() >> this->strides[l])
+                      << std::endl;
+        }
+        std::cout << "  memory = " << this->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+/*
+ * Flatritrie with a different number of bits matched at each level.
+ *
+ * FlatStrides<16, 8, 4, 4> matches IPv4 by 16 bits first, then 8 and twice
+ * by 4. Strides must sum up to 32 (IPv4) or 128 (IPv6) bits and the key type
+ * is selected accordingly. Shifts and masks of each level are known at
+ * compile time and the query is unrolled for the given shape.
+ */
+template<typename V, V def, int... STRIDES>
+class FlatStridesT
+    : public FlatStridesBase<std::conditional_t<(STRIDES + ...) == 32,
+                                                uint32_t, uint128_t>, V, def> {
+protected:
+    constexpr static int LEVELS = sizeof...(STRIDES);
+    constexpr static int BITS_TOTAL = (STRIDES + ...);
+    static_assert(BITS_TOTAL == 32 || BITS_TOTAL == 128,
+                  "Strides must cover an IPv4 or IPv6 address");
+    static_assert(((STRIDES > 0 && STRIDES <= 24) && ...),
+                  "Each stride must be within 1 to 24 bits");
+
+public:
+    using K = std::conditional_t<BITS_TOTAL == 32, uint32_t, uint128_t>;
+
+protected:
+    using Base = FlatStridesBase<K, V, def>;
+    using Slot = typename Base::Slot;
+
+    constexpr static std::array<int, LEVELS> STRIDE = {STRIDES...};
+
+    /* Right shift which brings bits of a level to the bottom */
+    constexpr static std::array<int, LEVELS> compute_shifts() {
+        std::array<int, LEVELS> shifts = {};
+        int consumed = 0;
+        for (int l = 0; l < LEVELS; l++) {
+            consumed += STRIDE[l];
+            shifts[l] = BITS_TOTAL - consumed;
+        }
+        return shifts;
+    }
+    constexpr static std::array<int, LEVELS> SHIFT = compute_shifts();
+
+    template<int L>
+    static uint32_t chunk(K ip) {
+        return (uint32_t)(ip >> SHIFT[L]) & ((1u << STRIDE[L]) - 1);
+    }
+
+    template<int L>
+    bool step(K ip, uint32_t &node, V &matched) const {
+        const Slot &slot = this->levels[L][((size_t)node << STRIDE[L]) | chunk<L>(ip)];
+        if (slot.value != def) {
+            matched = slot.value;
+        }
+        node = slot.child - 1;
+        return slot.child != 0;
+    }
+
+    template<size_t... L>
+    V query_unrolled(K ip, std::index_sequence<L...>) const {
+        V matched = this->root_value;
+        uint32_t node = 0;
+        /* Stops on the first level without a child */
+        (void)(this->template step<L>(ip, node, matched) && ...);
+        return matched;
+    }
+
+    /* Don't copy. */
+    FlatStridesT(const FlatStridesT &flat);
+
+public:
+    FlatStridesT() : Base({STRIDES...}) {}
+
+    V query_string(const std::string &addr) const {
+        K ip;
+        int mask;
+        parse_ip<K>(addr, ip, mask);
+        if (mask != -1 && mask != BITS_TOTAL) {
+            throw std::runtime_error("Query with partial mask.");
+        }
+        return this->query(ip);
+    }
+
+    V query(K ip) const {
+        return this->query_unrolled(ip, std::make_index_sequence<LEVELS>());
+    }
+};
+
+/*
+ * FlatStrides with strides chosen at runtime, e.g. by StrideOptimizer. Same
+ * tables, but the query loops over the levels.
+ */
+template<typename K=uint32_t, typename V=int32_t, V def=-1>
+class FlatStridesDyn : public FlatStridesBase<K, V, def> {
+protected:
+    using Base = FlatStridesBase<K, V, def>;
+    using Slot = typename Base::Slot;
+
+    /* Don't copy. */
+    FlatStridesDyn(const FlatStridesDyn &flat);
+
+public:
+    explicit FlatStridesDyn(const std::vector<int> &strides) : Base(strides) {}
+
+    V query_string(const std::string &addr) const {
+        K ip;
+        int mask;
+        parse_ip<K>(addr, ip, mask);
+        if (mask != -1 && mask != Base::BITS_TOTAL) {
+            throw std::runtime_error("Query with partial mask.");
+        }
+        return this->query(ip);
+    }
+
+    V query(K ip) const {
+        V matched = this->root_value;
+        uint32_t node = 0;
+        const size_t levels = this->strides.size();
+        for (size_t l = 0; l < levels; l++) {
+            const int stride = this->strides[l];
+            const uint32_t bits = (uint32_t)(ip >> this->shifts[l]) & ((1u << stride) - 1);
+            const Slot &slot = this->levels[l][((size_t)node << stride) | bits];
+            if (slot.value != def) {
+                matched = slot.value;
+            }
+            if (slot.child == 0) {
+                break;
+            }
+            node = slot.child - 1;
+        }
+        return matched;
+    }
+};
+
+/* FlatStrides<16, 8, 8> with default int32_t values */
+template<int... STRIDES>
+using FlatStrides = FlatStridesT<int32_t, -1, STRIDES...>;
+
+};
+#endif
@@ -0,0 +1,253 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _HASH48_H_
+#define _HASH48_H_
+
+#include <limits>
+#include <vector>
+#include <utility>
+#include <tritrie.hpp>
+#include <flatritrie.hpp>
+
+namespace Tritrie {
+
+/*
+ * Two-stage IPv6 lookup: a hash on the /48 boundary, then a short trie.
+ *
+ * Real tables are dominated by /32-/48 prefixes. A Flat<BITS, uint128_t> is
+ * built as usual and each of its entries at the /48 depth gets a slot in an
+ * open addressing hash keyed by the top 48 bits. A slot holds the entry and
+ * the best match on the path to it, so a hit skips the first 48/BITS levels
+ * and only longer prefixes are walked in the Flat subtree below.
+ *
+ * Most addresses are covered by /32-/47 prefixes only, and would miss the
+ * /48 hash. So entries at the /32 depth (rounded down to whole levels) are
+ * hashed the same way and probed first. A /32 slot tells whether there are
+ * any /48 entries below it; if there are none, the address is resolved by
+ * at most the few levels between /32 and /48 without the /48 probe.
+ * Addresses outside of every /32 block walk the Flat from the root, but
+ * never below /32.
+ */
+template<int BITS=8, typename V=int32_t, V def=-1>
+class Hash48 {
+protected:
+    using K = uint128_t;
+    using Table = Flat<BITS, K, V, def>;
+    using Entry = typename Table::Entry;
+    using Halves = typename Table::Halves;
+
+    static_assert(48 % BITS == 0, "Flat levels must end on the /48 boundary");
+
+    constexpr static int BITS_TOTAL = 128;
+    constexpr static int HASH_BITS = 48;
+    /* Levels resolved by a hash hit */
+    constexpr static int HASH_LEVELS = HASH_BITS / BITS;
+
+    /* Second probe, on the last level boundary not below /32 */
+    constexpr static int SHORT_LEVELS = 32 / BITS;
+    constexpr static int SHORT_BITS = SHORT_LEVELS * BITS;
+
+    /* Top 48 bits never reach it */
+    constexpr static uint64_t EMPTY = std::numeric_limits<uint64_t>::max();
+
+    struct Slot {
+        uint64_t key = EMPTY;
+        /* Flat entry at the hashed depth */
+        const Entry *entry = NULL;
+        /* Best match down to and including the entry */
+        V matched = def;
+        /* There are /48 entries below; only in the SHORT_BITS hash */
+        bool deep = false;
+    };
+
+    /* Open addressing hash of the entries at a single depth */
+    struct Hash {
+        std::vector<Slot> slots;
+        uint64_t slot_mask = 0;
+        int used = 0;
+
+        /* Fibonacci hashing of the top bits */
+        size_t slot_of(uint64_t key) const {
+            return ((key * 0x9e3779b97f4a7c15ULL) >> 20) & this->slot_mask;
+        }
+
+        void assign(const std::vector<Slot> &found) {
+            /* Load factor at most 1/2 keeps probe sequences short */
+            size_t capacity = 16;
+            while (capacity < 2 * found.size()) {
+                capacity *= 2;
+            }
+            this->slots.assign(capacity, Slot());
+            this->slot_mask = capacity - 1;
+            this->used = 0;
+            for (auto &slot: found) {
+                size_t pos = this->slot_of(slot.key);
+                while (this->slots[pos].key != EMPTY) {
+                    pos = (pos + 1) & this->slot_mask;
+                }
+                this->slots[pos] = slot;
+                this->used++;
+            }
+        }
+
+        const Slot *find(uint64_t key) const {
+            size_t pos = this->slot_of(key);
+            for (;;) {
+                const Slot &slot = this->slots[pos];
+                if (slot.key == key) {
+                    return &slot;
+                }
+                if (slot.key == EMPTY) {
+                    return NULL;
+                }
+                pos = (pos + 1) & this->slot_mask;
+            }
+        }
+
+        size_t memory() const {
+            return this->slots.capacity() * sizeof(Slot);
+        }
+
+        void clear() {
+            this->slots.clear();
+            this->slot_mask = 0;
+            this->used = 0;
+        }
+    };
+
+    Table flat;
+    /* Entries at the /48 depth */
+    Hash hash;
+    /* Entries at the SHORT_BITS depth */
+    Hash hash_short;
+
+    /*
+     * Collect Flat entries at the SHORT_BITS and /48 depths; true if there's
+     * any /48 entry in the subtree.
+     */
+    bool collect(const Entry *entry, int depth, uint64_t prefix, V matched,
+                 std::vector<Slot> &found_short, std::vector<Slot> &found) {
+        if (entry->value != def) {
+            matched = entry->value;
+        }
+        if (depth == HASH_LEVELS) {
+            found.push_back({prefix, entry, matched, false});
+            return true;
+        }
+        bool deep = false;
+        for (int i = 0; i < (1 << BITS); i++) {
+            if (entry->child[i] != NULL) {
+                deep |= this->collect(entry->child[i], depth + 1,
+                                      (prefix << BITS) | i, matched,
+                                      found_short, found);
+            }
+        }
+        if (depth == SHORT_LEVELS) {
+            found_short.push_back({prefix, entry, matched, deep});
+        }
+        return deep;
+    }
+
+    /* Continue the Flat walk below an entry at the START depth */
+    template<int START, size_t... L>
+    static V walk_tail(const Slot &slot, const Halves &key,
+                       std::index_sequence<L...>) {
+        const Entry *cur = slot.entry;
+        V matched = slot.matched;
+        auto noop = [] (const Entry *) {};
+        (void)(Table::step(Table::template chunk<START + L>(key),
+                           cur, matched, noop) && ...);
+        return matched;
+    }
+
+    void cleanup() {
+        this->hash.clear();
+        this->hash_short.clear();
+    }
+
+    /* Don't copy. */
+    Hash48(const Hash48 &hash);
+
+public:
+    Hash48() {}
+
+    void build(Tritrie<BITS, K, V, def> &trie) {
+        this->cleanup();
+        this->flat.build(trie);
+
+        std::vector<Slot> found_short, found;
+        this->collect(&this->flat.pages[0][0], 0, 0, def, found_short, found);
+        this->hash_short.assign(found_short);
+        this->hash.assign(found);
+    }
+
+    V query_string(const std::string &addr) const {
+        K ip;
+        int mask;
+        parse_ip<K>(addr, ip, mask);
+        if (mask != -1 && mask != BITS_TOTAL) {
+            throw std::runtime_error("Query with partial mask.");
+        }
+        return this->query(ip);
+    }
+
+    V query(K ip) const {
+        /* Querying uninitialized structure will fail */
+        assert(this->hash_short.slot_mask > 0);
+
+        const uint64_t high = ip >> 64;
+        const Halves key{high, (uint64_t)ip};
+        const Slot *slot = this->hash_short.find(high >> (64 - SHORT_BITS));
+        if (slot == NULL) {
+            /* Path to the address ends above SHORT_BITS - it'd be hashed */
+            return this->flat.template walk<SHORT_LEVELS - 1>(
+                key, [] (const Entry *) {});
+        }
+
+        if (slot->deep) {
+            const Slot *slot_deep = this->hash.find(high >> (64 - HASH_BITS));
+            if (slot_deep != NULL) {
+                if (this->flat.high_only) {
+                    return walk_tail<HASH_LEVELS>(*slot_deep, key, std::make_index_sequence<
+                                                  Table::LEVELS_HIGH - HASH_LEVELS>());
+                }
+                return walk_tail<HASH_LEVELS>(*slot_deep, key, std::make_index_sequence<
+                                              Table::LEVELS - HASH_LEVELS>());
+            }
+        }
+
+        /* Same for paths ending above /48 */
+        return walk_tail<SHORT_LEVELS>(*slot, key, std::make_index_sequence<
+                                       HASH_LEVELS - SHORT_LEVELS - 1>());
+    }
+
+    /* Number of /48 blocks in the hash */
+    int size() const {
+        return this->hash.used;
+    }
+
+    /* Bytes used by the hashes and the Flat */
+    size_t memory() const {
+        return (this->hash.memory() + this->hash_short.memory()
+                + this->flat.memory());
+    }
+
+    void debug() {
+        std::cout << "Hash48 debug stats:" << std::endl
+                  << "  /48 blocks = " << this->hash.used
+                  << " in " << this->hash.slots.size() << " slots" << std::endl
+                  << "  /" << SHORT_BITS << " blocks = " << this->hash_short.used
+                  << " in " << this->hash_short.slots.size() << " slots"
+                  << std::endl
+                  << "  flat entries = " << this->flat.size() << std::endl
+                  << "  memory = " << this->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+};
+#endif
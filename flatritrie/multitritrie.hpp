@@ -12,6 +12,8 @@
 #include <bitset>
 #include <cassert>
 #include <set>
+#include <new>
+#include <memory_resource>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -39,6 +41,8 @@ protected:
         /* 'def' for middle node TODO: or better - empty? */
         /* Longest Prefix Match value */
         V lpm_value;
+        /* Length of the prefix which set lpm_value */
+        uint8_t lpm_mask = 0;
         /* Accumulated matching entries */
         std::set<V> values;
 
@@ -59,12 +63,17 @@ protected:
     Node root;
     int nodes_cnt = 0;
 
-    /* Mask during insertion can only grow or stay the same */
-    int last_mask = 0;
+    /* Memory of the nodes; NULL when each one is on the heap */
+    std::pmr::memory_resource *const resource = NULL;
 
     Node *get_or_create(Node *cur, const uint8_t tri) {
         if (cur->child[tri] == NULL) {
-            cur->child[tri] = new Node();
+            if (this->resource == NULL) {
+                cur->child[tri] = new Node();
+            } else {
+                void *mem = this->resource->allocate(sizeof(Node), alignof(Node));
+                cur->child[tri] = new (mem) Node();
+            }
             this->nodes_cnt += 1;
         }
         return cur->child[tri];
@@ -77,14 +86,6 @@ protected:
            values */
         std::set<V> aggregated = cur->values;
 
-        /* Runtime sanity check */
-        if (mask < this->last_mask) {
-            std::cerr << "Inserting mask " << mask
-                      << " after mask " << this->last_mask << std::endl;
-            throw std::runtime_error("Invalid order of IP insertion to MultiTritrie");
-        }
-        this->last_mask = mask;
-
         assert(BITS_TOTAL > BITS);
 
         for (; mask_left >= BITS; mask_left -= BITS) {
@@ -124,23 +125,47 @@ protected:
              * etc.
              * (0xffffffff >> (BITS_TOTAL-mask_left)) << (BITS - mask_left)
              */
-            const K mask = ((MASK_MAX >> (BITS_TOTAL - mask_left))
-                            << (BITS - mask_left));
-            assert(mask != 0);
+            const K slot_mask = ((MASK_MAX >> (BITS_TOTAL - mask_left))
+                                 << (BITS - mask_left));
+            assert(slot_mask != 0);
 
             for (int tri = 0; tri < CHILDREN; tri++) {
-                if ((tri & mask) == ip) {
+                if ((tri & slot_mask) == ip) {
                     /* Insert here */
                     auto lvl = this->get_or_create(cur, tri);
-                    lvl->lpm_value = value;
-                    lvl->values.insert(aggregated.begin(), aggregated.end());
+                    this->set_value(lvl, mask, value, aggregated);
                 }
             }
         } else {
             /* After using whole mask, the IP should be 0 */
             assert(ip == 0);
-            cur->lpm_value = value;
-            cur->values.insert(aggregated.begin(), aggregated.end());
+            this->set_value(cur, mask, value, aggregated);
+        }
+    }
+
+    /*
+     * Longer prefixes inserted earlier keep their LPM value, but the new
+     * value still covers their nodes - push it down the whole subtree.
+     */
+    void set_value(Node *node, int mask, V value, const std::set<V> &aggregated) {
+        if (mask >= node->lpm_mask) {
+            node->lpm_value = value;
+            node->lpm_mask = mask;
+        }
+        node->values.insert(aggregated.begin(), aggregated.end());
+        for (int i = 0; i < CHILDREN; i++) {
+            if (node->child[i] != NULL) {
+                this->push_down(node->child[i], value);
+            }
+        }
+    }
+
+    void push_down(Node *node, V value) {
+        node->values.insert(value);
+        for (int i = 0; i < CHILDREN; i++) {
+            if (node->child[i] != NULL) {
+                this->push_down(node->child[i], value);
+            }
         }
     }
 
@@ -149,7 +174,12 @@ protected:
             if (node->child[i] != NULL) {
                 release(node->child[i]);
                 assert(this->nodes_cnt >= 0);
-                delete node->child[i];
+                if (this->resource == NULL) {
+                    delete node->child[i];
+                } else {
+                    /* Free the set of values; memory goes with the resource */
+                    node->child[i]->~Node();
+                }
                 node->child[i] = NULL;
                 this->nodes_cnt -= 1;
             }
@@ -200,6 +230,11 @@ protected:
 
 public:
     MultiTritrie() {}
+
+    /* Nodes taken from a memory resource, like with Tritrie */
+    explicit MultiTritrie(std::pmr::memory_resource *resource)
+        : resource(resource) {}
+
     ~MultiTritrie() {
         this->release(&this->root);
     }
@@ -0,0 +1,232 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _POPTRIE_H_
+#define _POPTRIE_H_
+
+#include <limits>
+#include <vector>
+#include <deque>
+#include <tritrie.hpp>
+
+namespace Tritrie {
+
+/*
+ * Bitmap compressed multibit trie in the style of Poptrie (Asai, Ohara).
+ *
+ * Built from a Tritrie<6> - each node matches 6 bits and describes its 64
+ * slots with two bitmaps. Bit in 'vector' marks a slot with an inner node
+ * and all inner children of a node are stored contiguously from base1, so
+ * the child index is a popcount of lower bits. Other slots are leaves with
+ * values pushed down from above; neighbouring leaves with the same value
+ * share a single stored value and 'leafvec' marks where a new run starts.
+ *
+ * Node takes 24 bytes instead of 64 pointers. Top 18 bits (three levels)
+ * are resolved with a single read from a direct pointing table.
+ */
+template<typename K=uint32_t, typename V=int32_t, V def=-1>
+class Poptrie {
+protected:
+    constexpr static int BITS = 6;
+    constexpr static int BITS_TOTAL = std::numeric_limits<K>::digits;
+    constexpr static int CHILDREN = (1<<BITS);
+    constexpr static int BITS_COMPLEMENT = (BITS_TOTAL - BITS);
+
+    /* Levels resolved by the direct pointing table */
+    constexpr static int DIRECT_LEVELS = 3;
+    constexpr static int DIRECT_BITS = DIRECT_LEVELS * BITS;
+
+    /* Direct entry holds a leaf index instead of a node index */
+    constexpr static uint32_t LEAF = 0x80000000u;
+
+    struct Node {
+        /* Slots with inner nodes */
+        uint64_t vector = 0;
+        /* Slots starting a run of leaves with a new value */
+        uint64_t leafvec = 0;
+        /* First leaf and first inner child of the node */
+        uint32_t base0 = 0;
+        uint32_t base1 = 0;
+    };
+
+    std::vector<uint32_t> direct;
+    std::vector<Node> nodes;
+    std::vector<V> leaves;
+
+    /* Tritrie node waiting for its Node to be described */
+    struct Pending {
+        typename Tritrie<BITS, K, V, def>::Node *node;
+        V inherited;
+        uint32_t idx;
+    };
+
+    static bool has_children(typename Tritrie<BITS, K, V, def>::Node *node) {
+        for (int i = 0; i < CHILDREN; i++) {
+            if (node->child[i] != NULL) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Describe a node; inner children are queued as a contiguous run */
+    void build_node(const Pending &pending, std::deque<Pending> &queue) {
+        auto *trie_node = pending.node;
+        const V value = (trie_node->value != def
+                         ? trie_node->value : pending.inherited);
+
+        Node desc;
+        desc.base0 = this->leaves.size();
+        desc.base1 = this->nodes.size();
+
+        bool first_leaf = true;
+        V last_leaf = def;
+        for (int i = 0; i < CHILDREN; i++) {
+            auto *child = trie_node->child[i];
+            if (child != NULL and has_children(child)) {
+                desc.vector |= 1ULL << i;
+                queue.push_back({child, value, (uint32_t)this->nodes.size()});
+                this->nodes.emplace_back();
+                continue;
+            }
+
+            V leaf = value;
+            if (child != NULL and child->value != def) {
+                leaf = child->value;
+            }
+            if (first_leaf or leaf != last_leaf) {
+                desc.leafvec |= 1ULL << i;
+                this->leaves.push_back(leaf);
+                first_leaf = false;
+                last_leaf = leaf;
+            }
+        }
+
+        if (this->nodes.size() > std::numeric_limits<uint32_t>::max()
+            or this->leaves.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("Poptrie index overflow");
+        }
+        this->nodes[pending.idx] = desc;
+    }
+
+    /* Fill direct table for all slots below the node at a given depth */
+    void build_direct(typename Tritrie<BITS, K, V, def>::Node *trie_node,
+                      V inherited, int depth, uint32_t prefix,
+                      std::deque<Pending> &queue) {
+        const V value = (trie_node != NULL and trie_node->value != def
+                         ? trie_node->value : inherited);
+
+        if (depth < DIRECT_LEVELS) {
+            for (int i = 0; i < CHILDREN; i++) {
+                auto *child = trie_node != NULL ? trie_node->child[i] : NULL;
+                build_direct(child, value, depth + 1,
+                             (prefix << BITS) | i, queue);
+            }
+            return;
+        }
+
+        if (trie_node != NULL and has_children(trie_node)) {
+            this->direct[prefix] = this->nodes.size();
+            queue.push_back({trie_node, inherited, (uint32_t)this->nodes.size()});
+            this->nodes.emplace_back();
+            return;
+        }
+
+        /* Neighbouring leaves share the value */
+        if (prefix == 0 or (this->direct[prefix - 1] & LEAF) == 0
+            or this->leaves.back() != value) {
+            this->leaves.push_back(value);
+        }
+        this->direct[prefix] = LEAF | (this->leaves.size() - 1);
+    }
+
+    void cleanup() {
+        this->direct.clear();
+        this->nodes.clear();
+        this->leaves.clear();
+    }
+
+    /* Don't copy. */
+    Poptrie(const Poptrie &poptrie);
+
+public:
+    Poptrie() {}
+
+    void build(Tritrie<BITS, K, V, def> &trie) {
+        this->cleanup();
+        this->direct.resize(1 << DIRECT_BITS);
+
+        std::deque<Pending> queue;
+        this->build_direct(&trie.root, def, 0, 0, queue);
+
+        /* Breadth-first, so that children are allocated together */
+        while (!queue.empty()) {
+            this->build_node(queue.front(), queue);
+            queue.pop_front();
+        }
+        this->nodes.shrink_to_fit();
+        this->leaves.shrink_to_fit();
+    }
+
+    V query_string(const std::string &addr) const {
+        K ip;
+        int mask;
+        parse_ip<K>(addr, ip, mask);
+        if (mask != -1 && mask != BITS_TOTAL) {
+            throw std::runtime_error("Query with partial mask.");
+        }
+        return this->query(ip);
+    }
+
+    POPCNT_TARGET V query(K ip) const {
+        /* Querying uninitialized structure will fail */
+        assert(this->direct.size() > 0);
+
+        const uint32_t entry = this->direct[ip >> (BITS_TOTAL - DIRECT_BITS)];
+        if (entry & LEAF) {
+            return this->leaves[entry & ~LEAF];
+        }
+        ip <<= DIRECT_BITS;
+
+        const Node *node = &this->nodes[entry];
+        for (;;) {
+            const int tri = ip >> BITS_COMPLEMENT;
+            /* Slots up to and including tri; wraps correctly for 63 */
+            const uint64_t below = ((1ULL << tri) << 1) - 1;
+            if (node->vector & (1ULL << tri)) {
+                const int nth = __builtin_popcountll(node->vector & below);
+                node = &this->nodes[node->base1 + nth - 1];
+                ip <<= BITS;
+                continue;
+            }
+            const int nth = __builtin_popcountll(node->leafvec & below);
+            return this->leaves[node->base0 + nth - 1];
+        }
+    }
+
+    int size() const {
+        return this->nodes.size();
+    }
+
+    /* Bytes used by direct, node and leaf tables */
+    size_t memory() const {
+        return (this->direct.capacity() * sizeof(uint32_t)
+                + this->nodes.capacity() * sizeof(Node)
+                + this->leaves.capacity() * sizeof(V));
+    }
+
+    void debug() {
+        std::cout << "Poptrie debug stats:" << std::endl
+                  << "  nodes = " << this->nodes.size()
+                  << " of " << sizeof(Node) << "B" << std::endl
+                  << "  leaves = " << this->leaves.size() << std::endl
+                  << "  memory = " << this->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+};
+#endif
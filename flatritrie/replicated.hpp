@@ -0,0 +1,273 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _REPLICATED_H_
+#define _REPLICATED_H_
+
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <tritrie.hpp>
+
+namespace Tritrie {
+
+/* NUMA topology read from sysfs; a single node on machines without it */
+class Numa {
+protected:
+    /* Kernel ID of each node with CPUs; nodes are numbered densely here */
+    std::vector<int> node_ids;
+    /* CPUs of each node */
+    std::vector<std::vector<int>> node_cpus;
+    /* Node of each CPU */
+    std::vector<int> cpu_node;
+
+    /* Parse "0-3,8-11" */
+    static std::vector<int> parse_cpulist(const std::string &list) {
+        std::vector<int> cpus;
+        size_t pos = 0;
+        while (pos < list.size()) {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos) {
+                end = list.size();
+            }
+            const std::string range = list.substr(pos, end - pos);
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = (dash == std::string::npos
+                              ? first : std::stoi(range.substr(dash + 1)));
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+            pos = end + 1;
+        }
+        return cpus;
+    }
+
+    /* Read a sysfs list; empty if there's no such file */
+    static std::vector<int> read_list(const std::string &path) {
+        std::ifstream file(path);
+        std::string list;
+        if (!std::getline(file, list)) {
+            return {};
+        }
+        return parse_cpulist(list);
+    }
+
+    Numa() {
+        /* Node IDs can be sparse; memory-only nodes have no CPUs to pin to */
+        const std::string sysfs = "/sys/devices/system/node/";
+        std::vector<int> ids = read_list(sysfs + "has_cpu");
+        if (ids.empty()) {
+            ids = read_list(sysfs + "online");
+        }
+        for (int id: ids) {
+            std::vector<int> cpus = read_list(
+                sysfs + "node" + std::to_string(id) + "/cpulist");
+            if (!cpus.empty()) {
+                this->node_ids.push_back(id);
+                this->node_cpus.push_back(cpus);
+            }
+        }
+
+        if (this->node_cpus.empty()) {
+            /* No NUMA information - everything is local */
+            std::vector<int> all;
+            for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++) {
+                all.push_back(cpu);
+            }
+            this->node_ids = {0};
+            this->node_cpus.push_back(all);
+        }
+
+        for (size_t node = 0; node < this->node_cpus.size(); node++) {
+            for (int cpu: this->node_cpus[node]) {
+                if (cpu >= (int)this->cpu_node.size()) {
+                    this->cpu_node.resize(cpu + 1, 0);
+                }
+                this->cpu_node[cpu] = node;
+            }
+        }
+    }
+
+public:
+    static const Numa &get() {
+        static const Numa numa;
+        return numa;
+    }
+
+    int nodes() const {
+        return this->node_cpus.size();
+    }
+
+    /* Node of the CPU the calling thread runs on */
+    int current_node() const {
+        const int cpu = sched_getcpu();
+        if (cpu < 0 or cpu >= (int)this->cpu_node.size()) {
+            return 0;
+        }
+        return this->cpu_node[cpu];
+    }
+
+    /* Restrict the calling thread to CPUs of a node */
+    void pin_to_node(int node) const {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu: this->node_cpus.at(node)) {
+            CPU_SET(cpu, &set);
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            throw std::runtime_error("Unable to pin thread to a NUMA node");
+        }
+    }
+
+    /*
+     * Allocate memory of the calling thread only from a node, or
+     * according to the default policy again when node is -1.
+     */
+    void bind_memory(int node) const {
+        long ret;
+        if (node == -1) {
+            ret = syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+        } else {
+            const int id = this->node_ids.at(node);
+            std::vector<unsigned long> mask(id / (8 * sizeof(unsigned long)) + 1);
+            mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+            ret = syscall(SYS_set_mempolicy, MPOL_BIND, mask.data(),
+                          mask.size() * 8 * sizeof(unsigned long) + 1);
+        }
+        if (ret != 0) {
+            throw std::runtime_error("Unable to set NUMA memory policy");
+        }
+    }
+};
+
+/* How Replicated places the memory of a replica on its node */
+enum class Placement {
+    /* Kernel puts pages where they are first touched - by the builder */
+    FIRST_TOUCH,
+    /* Builder memory policy bound to the node; fails rather than spills */
+    BIND,
+};
+
+/*
+ * One copy of a table per NUMA node with CPUs.
+ *
+ * Each replica is constructed and built by a thread pinned to its node, so
+ * the kernel first-touch policy places its memory locally; with
+ * Placement::BIND the builder memory policy is also bound to the node.
+ * Queries go to the replica of the node the calling thread is on.
+ *
+ * With a single node there's one replica built by the calling thread.
+ */
+template<typename T>
+class Replicated {
+protected:
+    std::vector<std::unique_ptr<T>> replicas;
+
+    /* Don't copy. */
+    Replicated(const Replicated &replicated);
+
+public:
+    Replicated() {}
+
+    /* Build a replica per node by calling build_fn(T &) on that node */
+    template<typename Fn>
+    void build(Fn build_fn, Placement placement = Placement::FIRST_TOUCH) {
+        const Numa &numa = Numa::get();
+        const int nodes = numa.nodes();
+        this->replicas.clear();
+        this->replicas.resize(nodes);
+
+        if (nodes == 1) {
+            this->replicas[0].reset(new T());
+            build_fn(*this->replicas[0]);
+            return;
+        }
+
+        std::vector<std::thread> builders;
+        std::vector<std::exception_ptr> errors(nodes);
+        for (int node = 0; node < nodes; node++) {
+            builders.emplace_back([this, &numa, &build_fn, &errors, node, placement] () {
+                try {
+                    numa.pin_to_node(node);
+                    if (placement == Placement::BIND) {
+                        numa.bind_memory(node);
+                    }
+                    this->replicas[node].reset(new T());
+                    build_fn(*this->replicas[node]);
+                    if (placement == Placement::BIND) {
+                        numa.bind_memory(-1);
+                    }
+                } catch (...) {
+                    errors[node] = std::current_exception();
+                }
+            });
+        }
+        for (auto &builder: builders) {
+            builder.join();
+        }
+        for (auto &error: errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+    /**
+     * Replica local to the calling thread. The node is looked up once per
+     * thread, so readers have to be pinned to a node (like DPDK lcores); a
+     * thread which migrates keeps reading the replica of its first node.
+     * Unpinned threads should pick replica(Numa::get().current_node())
+     * themselves, once per burst.
+     */
+    const T &local() const {
+        static thread_local int node = Numa::get().current_node();
+        return *this->replicas[node];
+    }
+
+    const T &replica(int node) const {
+        return *this->replicas.at(node);
+    }
+
+    template<typename K>
+    auto query(K ip) const {
+        return this->local().query(ip);
+    }
+
+    auto query_string(const std::string &addr) const {
+        return this->local().query_string(addr);
+    }
+
+    int nodes() const {
+        return this->replicas.size();
+    }
+
+    /* Bytes used by all replicas */
+    size_t memory() const {
+        size_t bytes = 0;
+        for (auto &replica: this->replicas) {
+            bytes += replica->memory();
+        }
+        return bytes;
+    }
+
+    void debug() {
+        std::cout << "Replicated debug stats:" << std::endl
+                  << "  replicas = " << this->replicas.size() << std::endl
+                  << "  memory = " << this->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+};
+#endif
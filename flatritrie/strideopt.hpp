@@ -0,0 +1,152 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _STRIDEOPT_H_
+#define _STRIDEOPT_H_
+
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <tritrie.hpp>
+
+namespace Tritrie {
+
+/*
+ * Chooses FlatStrides levels for a given prefix set.
+ *
+ * Controlled prefix expansion (Srinivasan, Varghese): a level starting at
+ * depth i with stride s takes nodes(i) * 2^s slots, where nodes(i) is the
+ * number of distinct i-bit prefixes of networks longer than i bits - exactly
+ * what FlatStrides allocates. Dynamic programming over the level boundaries
+ * finds, for each number of levels, the strides with the least memory. The
+ * plan is the fewest levels which fit in the byte budget.
+ */
+template<typename K=uint32_t>
+class StrideOptimizer {
+protected:
+    constexpr static int BITS_TOTAL = std::numeric_limits<K>::digits;
+    constexpr static size_t INFINITE = std::numeric_limits<size_t>::max();
+
+    std::vector<std::pair<K, int>> prefixes;
+
+    /* Saturating nodes * 2^stride * slot_bytes */
+    static size_t level_bytes(size_t nodes, int stride, size_t slot_bytes) {
+        const size_t slots_max = INFINITE / slot_bytes;
+        if (nodes > (slots_max >> stride)) {
+            return INFINITE;
+        }
+        return (nodes << stride) * slot_bytes;
+    }
+
+public:
+    void add(const std::string &addr_mask) {
+        K ip;
+        int mask;
+        parse_ip<K>(addr_mask, ip, mask);
+        if (mask < 0 || mask > BITS_TOTAL) {
+            throw std::runtime_error("Address without a valid mask");
+        }
+        this->prefixes.push_back({ip, mask});
+    }
+
+    /* Number of networks of each mask, 0 to BITS_TOTAL */
+    std::vector<size_t> histogram() const {
+        std::vector<size_t> counts(BITS_TOTAL + 1);
+        for (auto &prefix: this->prefixes) {
+            counts[prefix.second]++;
+        }
+        return counts;
+    }
+
+    /* Nodes a level starting at each depth needs; root always exists */
+    std::vector<size_t> nodes() const {
+        std::vector<size_t> counts(BITS_TOTAL + 1);
+        counts[0] = 1;
+        std::vector<K> heads;
+        for (int depth = 1; depth < BITS_TOTAL; depth++) {
+            heads.clear();
+            for (auto &prefix: this->prefixes) {
+                if (prefix.second > depth) {
+                    heads.push_back(prefix.first >> (BITS_TOTAL - depth));
+                }
+            }
+            std::sort(heads.begin(), heads.end());
+            counts[depth] = std::unique(heads.begin(), heads.end()) - heads.begin();
+        }
+        return counts;
+    }
+
+    /* Bytes FlatStrides with given strides will use for the prefixes */
+    size_t cost(const std::vector<int> &strides, size_t slot_bytes) const {
+        const auto counts = this->nodes();
+        size_t bytes = 0;
+        int depth = 0;
+        for (int stride: strides) {
+            const size_t level = level_bytes(counts[depth], stride, slot_bytes);
+            if (level == INFINITE or bytes > INFINITE - level) {
+                return INFINITE;
+            }
+            bytes += level;
+            depth += stride;
+        }
+        return bytes;
+    }
+
+    /**
+     * Fewest levels of at most max_stride bits whose tables take at most
+     * budget bytes; the least memory among those.
+     */
+    std::vector<int> optimize(size_t budget, size_t slot_bytes,
+                              int max_stride = 24) const {
+        const auto counts = this->nodes();
+
+        /* best[r][j]: least bytes to cover j bits with r levels */
+        std::vector<std::vector<size_t>> best(
+            BITS_TOTAL + 1, std::vector<size_t>(BITS_TOTAL + 1, INFINITE));
+        std::vector<std::vector<int>> from(
+            BITS_TOTAL + 1, std::vector<int>(BITS_TOTAL + 1, -1));
+        best[0][0] = 0;
+
+        for (int r = 1; r <= BITS_TOTAL; r++) {
+            for (int j = 1; j <= BITS_TOTAL; j++) {
+                for (int i = std::max(0, j - max_stride); i < j; i++) {
+                    if (best[r - 1][i] == INFINITE) {
+                        continue;
+                    }
+                    const size_t level = level_bytes(counts[i], j - i, slot_bytes);
+                    if (level == INFINITE or level > INFINITE - best[r - 1][i]) {
+                        continue;
+                    }
+                    const size_t bytes = best[r - 1][i] + level;
+                    if (bytes < best[r][j]) {
+                        best[r][j] = bytes;
+                        from[r][j] = i;
+                    }
+                }
+            }
+
+            if (best[r][BITS_TOTAL] <= budget) {
+                /* Walk the boundaries back */
+                std::vector<int> strides;
+                for (int j = BITS_TOTAL, level = r; level > 0; level--) {
+                    const int i = from[level][j];
+                    strides.push_back(j - i);
+                    j = i;
+                }
+                std::reverse(strides.begin(), strides.end());
+                return strides;
+            }
+        }
+        throw std::runtime_error("No strides fit in the memory budget");
+    }
+
+    int size() const {
+        return this->prefixes.size();
+    }
+};
+
+};
+#endif
@@ -0,0 +1,334 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _TABLEHANDLE_H_
+#define _TABLEHANDLE_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <tritrie.hpp>
+
+namespace Tritrie {
+
+/*
+ * Replaceable table with lock-free readers.
+ *
+ * Tables are immutable once built; a reload builds a new one from scratch
+ * and publishes it with a single atomic pointer swap. Readers never wait:
+ * each has a slot where it stores the global epoch for the duration of a
+ * query. Swap bumps the epoch, so a retired table can be freed once no slot
+ * holds an epoch from before the swap - every reader which could have
+ * loaded it has passed a quiescent point since.
+ *
+ * A background thread rebuilds on request or when a watched file changes
+ * and retries freeing tables pinned by slow readers. Readers have to be
+ * gone before the handle is destroyed.
+ */
+template<typename T>
+class TableHandle {
+protected:
+    /* Slot epoch of a reader between queries */
+    constexpr static uint64_t IDLE = 0;
+
+    /* How often pinned tables are retried without anything else to do */
+    constexpr static std::chrono::milliseconds RECLAIM_INTERVAL{100};
+
+    /* Own cache line, so readers don't invalidate each other */
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{IDLE};
+        /* Taken by a Reader; guarded by the mutex */
+        bool used = false;
+    };
+
+    struct Retired {
+        T *table;
+        /* Epoch just before the swap */
+        uint64_t epoch;
+    };
+
+    std::function<void(T &)> build_fn;
+
+    std::atomic<T *> current{NULL};
+    std::atomic<uint64_t> epoch{1};
+
+    /* Guards everything below, never taken by queries */
+    mutable std::mutex mutex;
+    std::deque<Slot> slots;
+    std::vector<Retired> retired;
+
+    std::thread worker;
+    std::condition_variable wakeup;
+    bool reload_requested = false;
+    bool stopping = false;
+
+    /* Watched file; empty if none */
+    std::string watch_path;
+    std::chrono::milliseconds watch_interval{1000};
+    struct timespec watch_mtime = {};
+    off_t watch_size = -1;
+
+    /* Tables published so far and builds which failed */
+    std::atomic<int> generation{0};
+    int failures = 0;
+    std::string last_error;
+
+    Slot *take_slot() {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for (auto &slot: this->slots) {
+            if (not slot.used) {
+                slot.used = true;
+                return &slot;
+            }
+        }
+        this->slots.emplace_back();
+        this->slots.back().used = true;
+        return &this->slots.back();
+    }
+
+    void return_slot(Slot *slot) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        slot->used = false;
+    }
+
+    /* Free retired tables which no reader can be using */
+    void reclaim_locked() {
+        uint64_t oldest = std::numeric_limits<uint64_t>::max();
+        for (auto &slot: this->slots) {
+            const uint64_t seen = slot.epoch.load();
+            if (seen != IDLE) {
+                oldest = std::min(oldest, seen);
+            }
+        }
+
+        /* Readers which entered after the swap got the new table */
+        auto pinned = this->retired.begin();
+        for (auto &item: this->retired) {
+            if (item.epoch < oldest) {
+                delete item.table;
+            } else {
+                *pinned++ = item;
+            }
+        }
+        this->retired.erase(pinned, this->retired.end());
+    }
+
+    /* File changed since the last check */
+    bool watched_changed() {
+        struct stat info;
+        if (stat(this->watch_path.c_str(), &info) != 0) {
+            /* Being replaced or gone - keep the current table */
+            return false;
+        }
+        const bool changed = (info.st_mtim.tv_sec != this->watch_mtime.tv_sec
+                              or info.st_mtim.tv_nsec != this->watch_mtime.tv_nsec
+                              or info.st_size != this->watch_size);
+        this->watch_mtime = info.st_mtim;
+        this->watch_size = info.st_size;
+        return changed;
+    }
+
+    /* Background rebuilds and reclamation */
+    void run() {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (not this->stopping) {
+            const bool watching = not this->watch_path.empty();
+            this->wakeup.wait_for(lock, watching ? this->watch_interval
+                                                 : RECLAIM_INTERVAL);
+            if (this->stopping) {
+                break;
+            }
+
+            bool reload = this->reload_requested;
+            this->reload_requested = false;
+            if (watching and this->watched_changed()) {
+                reload = true;
+            }
+
+            if (reload) {
+                lock.unlock();
+                try {
+                    this->reload();
+                } catch (std::exception &error) {
+                    /* Readers stay on the old table */
+                    lock.lock();
+                    this->failures++;
+                    this->last_error = error.what();
+                    continue;
+                }
+                lock.lock();
+            }
+            this->reclaim_locked();
+        }
+    }
+
+    /* Don't copy. */
+    TableHandle(const TableHandle &handle);
+
+public:
+    /**
+     * Per thread access to the table. Queries go to the table published
+     * last when they start; an older one stays alive until they end.
+     */
+    class Reader {
+    protected:
+        TableHandle &handle;
+        Slot *slot;
+
+        /* Don't copy. */
+        Reader(const Reader &reader);
+
+    public:
+        explicit Reader(TableHandle &handle)
+            : handle(handle), slot(handle.take_slot()) {}
+
+        ~Reader() {
+            this->handle.return_slot(this->slot);
+        }
+
+        /* Call fn(const T &) on the current table */
+        template<typename Fn>
+        auto with(Fn fn) {
+            /* Sequentially consistent: the store precedes the table load */
+            this->slot->epoch.store(this->handle.epoch.load());
+            struct Leave {
+                Slot *slot;
+                ~Leave() {
+                    this->slot->epoch.store(IDLE, std::memory_order_release);
+                }
+            } leave{this->slot};
+            return fn(*this->handle.current.load());
+        }
+
+        template<typename K>
+        auto query(K ip) {
+            return this->with([ip] (const T &table) {
+                return table.query(ip);
+            });
+        }
+
+        auto query_string(const std::string &addr) {
+            return this->with([&addr] (const T &table) {
+                return table.query_string(addr);
+            });
+        }
+    };
+
+    /**
+     * Handle of tables built by build_fn(T &) on a default constructed T.
+     * The first one is built right away, on the calling thread.
+     */
+    template<typename Fn>
+    explicit TableHandle(Fn build_fn) : build_fn(build_fn) {
+        this->reload();
+        this->worker = std::thread([this] () { this->run(); });
+    }
+
+    ~TableHandle() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->wakeup.notify_all();
+        this->worker.join();
+
+        for (auto &item: this->retired) {
+            delete item.table;
+        }
+        delete this->current.load();
+    }
+
+    /* Build a new table on the calling thread and publish it */
+    void reload() {
+        std::unique_ptr<T> table(new T());
+        this->build_fn(*table);
+        this->publish(table.release());
+    }
+
+    /* Swap in a table built elsewhere; handle takes the ownership */
+    void publish(T *table) {
+        T *old = this->current.exchange(table);
+        const uint64_t retired_at = this->epoch.fetch_add(1);
+        this->generation++;
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (old != NULL) {
+            this->retired.push_back({old, retired_at});
+        }
+        this->reclaim_locked();
+    }
+
+    /* Rebuild on the background thread */
+    void request_reload() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->reload_requested = true;
+        }
+        this->wakeup.notify_all();
+    }
+
+    /* Rebuild in the background whenever the file changes */
+    void watch(const std::string &path,
+               std::chrono::milliseconds interval = std::chrono::milliseconds(1000)) {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->watch_path = path;
+            this->watch_interval = interval;
+            /* Current contents are assumed to be loaded already */
+            this->watched_changed();
+        }
+        this->wakeup.notify_all();
+    }
+
+    /* Try to free retired tables now; returns number still pinned */
+    int reclaim() {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->reclaim_locked();
+        return this->retired.size();
+    }
+
+    /* Number of tables published so far */
+    int generations() const {
+        return this->generation.load();
+    }
+
+    /* Bytes used by the current table */
+    size_t memory() const {
+        /* Table can't be freed while the lock is held */
+        std::lock_guard<std::mutex> lock(this->mutex);
+        return this->current.load()->memory();
+    }
+
+    void debug() {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        std::cout << "TableHandle debug stats:" << std::endl
+                  << "  generations = " << this->generation.load()
+                  << "; failed builds = " << this->failures << std::endl
+                  << "  retired tables pinned by readers = "
+                  << this->retired.size() << std::endl
+                  << "  reader slots = " << this->slots.size() << std::endl
+                  << "  watching = "
+                  << (this->watch_path.empty() ? "nothing" : this->watch_path)
+                  << std::endl;
+        if (not this->last_error.empty()) {
+            std::cout << "  last error = " << this->last_error << std::endl;
+        }
+        std::cout << "  memory = " << this->current.load()->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+};
+#endif
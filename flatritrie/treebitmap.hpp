@@ -0,0 +1,419 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ * bla@thera.be, https://github.com/blaa/flatritrie
+ */
+
+#ifndef _TREEBITMAP_H_
+#define _TREEBITMAP_H_
+
+#include <array>
+#include <limits>
+#include <vector>
+#include <tritrie.hpp>
+
+namespace Tritrie {
+
+/*
+ * Tree Bitmap multibit trie (Eatherton, Varghese, Dittia).
+ *
+ * Each node matches STRIDE bits and has two bitmaps: the internal one marks
+ * prefixes ending inside the node (2^STRIDE - 1 possible prefixes of length
+ * 0 to STRIDE-1) and the external one marks existing children. Children of
+ * a node are stored contiguously, as are its results, and are located with
+ * a popcount.
+ *
+ * Unlike Tritrie and Poptrie this doesn't expand or push down prefixes, so
+ * prefixes can be added, replaced and removed in any order and at any time
+ * by reallocating only the child or result block of a single node. Freed
+ * blocks are reused for the next allocation of the same size.
+ */
+template<int STRIDE=4, typename K=uint32_t, typename V=int32_t, V def=-1>
+class TreeBitmap {
+protected:
+    static_assert(STRIDE >= 1 && STRIDE <= 5, "Bitmaps must fit in 32 bits");
+
+    constexpr static int BITS_TOTAL = std::numeric_limits<K>::digits;
+    constexpr static int CHILDREN = (1<<STRIDE);
+    constexpr static int STRIDE_COMPLEMENT = (BITS_TOTAL - STRIDE);
+
+    /* Number of lookups walked in lockstep by query_batch */
+    constexpr static int BATCH = 16;
+
+    struct Node {
+        /* Prefix of length L with bits P is at bit (1 << L) - 1 + P */
+        uint32_t internal = 0;
+        /* Child for each value of the next STRIDE bits */
+        uint32_t external = 0;
+        uint32_t child_base = 0;
+        uint32_t result_base = 0;
+    };
+
+    /* Internal bitmap positions of all prefixes matching a given chunk */
+    constexpr static std::array<uint32_t, CHILDREN> compute_matching() {
+        std::array<uint32_t, CHILDREN> matching = {};
+        for (int chunk = 0; chunk < CHILDREN; chunk++) {
+            for (int len = 0; len < STRIDE; len++) {
+                matching[chunk] |= 1u << ((1 << len) - 1 + (chunk >> (STRIDE - len)));
+            }
+        }
+        return matching;
+    }
+    constexpr static std::array<uint32_t, CHILDREN> MATCHING = compute_matching();
+
+    /* Table allocated in blocks of up to CHILDREN items */
+    template<typename T>
+    struct Blocks {
+        std::vector<T> items;
+        /* Released block offsets by block size */
+        std::array<std::vector<uint32_t>, CHILDREN + 1> released;
+
+        uint32_t alloc(int size) {
+            if (size == 0) {
+                return 0;
+            }
+            auto &free = this->released[size];
+            if (!free.empty()) {
+                const uint32_t base = free.back();
+                free.pop_back();
+                return base;
+            }
+            const size_t base = this->items.size();
+            if (base + size > std::numeric_limits<uint32_t>::max()) {
+                throw std::runtime_error("TreeBitmap table overflow");
+            }
+            this->items.resize(base + size);
+            return base;
+        }
+
+        void release(uint32_t base, int size) {
+            if (size > 0) {
+                this->released[size].push_back(base);
+            }
+        }
+
+        /* Reallocate a block with an item inserted at a given rank */
+        uint32_t insert(uint32_t base, int size, int rank, const T &item) {
+            const uint32_t moved = this->alloc(size + 1);
+            for (int i = 0; i < rank; i++) {
+                this->items[moved + i] = this->items[base + i];
+            }
+            this->items[moved + rank] = item;
+            for (int i = rank; i < size; i++) {
+                this->items[moved + i + 1] = this->items[base + i];
+            }
+            this->release(base, size);
+            return moved;
+        }
+
+        /* Reallocate a block without an item at a given rank */
+        uint32_t erase(uint32_t base, int size, int rank) {
+            const uint32_t moved = this->alloc(size - 1);
+            for (int i = 0, j = 0; i < size; i++) {
+                if (i != rank) {
+                    this->items[moved + j++] = this->items[base + i];
+                }
+            }
+            this->release(base, size);
+            return moved;
+        }
+
+        void clear() {
+            this->items.clear();
+            for (auto &free: this->released) {
+                free.clear();
+            }
+        }
+    };
+
+    Blocks<Node> nodes;
+    Blocks<V> results;
+
+    /* Rank of a bit among the set bits of a bitmap */
+    static int rank(uint32_t bitmap, int bit) {
+        return __builtin_popcount(bitmap & ((1u << bit) - 1));
+    }
+
+    /* STRIDE bits starting at a given depth */
+    static uint32_t chunk_at(K ip, int consumed) {
+        if (consumed >= BITS_TOTAL) {
+            return 0;
+        }
+        return (ip << consumed) >> STRIDE_COMPLEMENT;
+    }
+
+    /* Walk to the node holding a prefix, optionally creating the path */
+    struct Path {
+        uint32_t nodes[BITS_TOTAL / STRIDE + 2];
+        uint32_t chunks[BITS_TOTAL / STRIDE + 2];
+        int depth = 0;
+    };
+
+    bool find_node(K ip, int mask, bool create, Path &path) {
+        uint32_t node = 0;
+        path.depth = 0;
+        for (int consumed = 0; mask - consumed >= STRIDE; consumed += STRIDE) {
+            const uint32_t chunk = chunk_at(ip, consumed);
+            path.nodes[path.depth] = node;
+            path.chunks[path.depth] = chunk;
+            path.depth++;
+
+            const Node cur = this->nodes.items[node];
+            const int pos = rank(cur.external, chunk);
+            if ((cur.external & (1u << chunk)) == 0) {
+                if (!create) {
+                    return false;
+                }
+                const int count = __builtin_popcount(cur.external);
+                const uint32_t base = this->nodes.insert(cur.child_base, count,
+                                                         pos, Node());
+                this->nodes.items[node].child_base = base;
+                this->nodes.items[node].external |= 1u << chunk;
+            }
+            node = this->nodes.items[node].child_base + pos;
+        }
+        path.nodes[path.depth] = node;
+        return true;
+    }
+
+    /* Internal bitmap bit for a prefix ending within a node */
+    static int internal_bit(K ip, int mask) {
+        const int consumed = mask / STRIDE * STRIDE;
+        const int len = mask - consumed;
+        const uint32_t bits = len == 0 ? 0 : chunk_at(ip, consumed) >> (STRIDE - len);
+        return (1 << len) - 1 + bits;
+    }
+
+    void add_ip(K ip, int mask, V value) {
+        Path path;
+        this->find_node(ip, mask, true, path);
+        const uint32_t node = path.nodes[path.depth];
+        const int bit = internal_bit(ip, mask);
+
+        Node &cur = this->nodes.items[node];
+        const int pos = rank(cur.internal, bit);
+        if (cur.internal & (1u << bit)) {
+            /* Replace */
+            this->results.items[cur.result_base + pos] = value;
+            return;
+        }
+        const int count = __builtin_popcount(cur.internal);
+        const uint32_t base = this->results.insert(cur.result_base, count,
+                                                   pos, value);
+        /* Node table wasn't touched, reference is valid */
+        cur.result_base = base;
+        cur.internal |= 1u << bit;
+    }
+
+    bool remove_ip(K ip, int mask) {
+        Path path;
+        if (!this->find_node(ip, mask, false, path)) {
+            return false;
+        }
+        uint32_t node = path.nodes[path.depth];
+        const int bit = internal_bit(ip, mask);
+
+        Node &cur = this->nodes.items[node];
+        if ((cur.internal & (1u << bit)) == 0) {
+            return false;
+        }
+        const int count = __builtin_popcount(cur.internal);
+        cur.result_base = this->results.erase(cur.result_base, count,
+                                              rank(cur.internal, bit));
+        cur.internal &= ~(1u << bit);
+
+        /* Prune nodes left without results and children */
+        for (int d = path.depth - 1; d >= 0; d--) {
+            const Node &empty = this->nodes.items[path.nodes[d + 1]];
+            if (empty.internal != 0 or empty.external != 0) {
+                break;
+            }
+            /* Erasing may reallocate the table; don't hold a reference */
+            const uint32_t parent = path.nodes[d];
+            const uint32_t chunk = path.chunks[d];
+            const Node desc = this->nodes.items[parent];
+            const uint32_t base = this->nodes.erase(desc.child_base,
+                                                    __builtin_popcount(desc.external),
+                                                    rank(desc.external, chunk));
+            this->nodes.items[parent].child_base = base;
+            this->nodes.items[parent].external &= ~(1u << chunk);
+        }
+        return true;
+    }
+
+    void add_trie_node(typename Tritrie<STRIDE, K, V, def>::Node *node,
+                       K prefix, int depth) {
+        const int len = std::min(depth * STRIDE, BITS_TOTAL);
+        if (node->value != def) {
+            this->add_ip(prefix, len, node->value);
+        }
+        const int shift = BITS_TOTAL - (depth + 1) * STRIDE;
+        for (int i = 0; i < CHILDREN; i++) {
+            if (node->child[i] != NULL) {
+                /* Last Tritrie level can be shorter than STRIDE */
+                const K bits = shift >= 0 ? (K)i << shift : (K)i >> -shift;
+                this->add_trie_node(node->child[i], prefix | bits, depth + 1);
+            }
+        }
+    }
+
+    void cleanup() {
+        this->nodes.clear();
+        this->results.clear();
+        /* Root */
+        this->nodes.alloc(1);
+    }
+
+    /* Don't copy. */
+    TreeBitmap(const TreeBitmap &tree);
+
+public:
+    TreeBitmap() {
+        this->cleanup();
+    }
+
+    /* Build from a Tritrie of the same stride */
+    void build(Tritrie<STRIDE, K, V, def> &trie) {
+        this->cleanup();
+        this->add_trie_node(&trie.root, 0, 0);
+    }
+
+    /* Add or replace a prefix, in any order */
+    void add(const std::string addr_mask, V value) {
+        K ip;
+        int mask;
+        parse_ip<K>(addr_mask, ip, mask);
+        if (mask == -1) {
+            throw std::runtime_error("Address without a mask");
+        }
+        if (mask < 0 || mask > BITS_TOTAL)
+            throw std::runtime_error("Invalid mask");
+        this->add_ip(ip, mask, value);
+    }
+
+    /* Remove a prefix; returns false if it didn't exist */
+    bool remove(const std::string addr_mask) {
+        K ip;
+        int mask;
+        parse_ip<K>(addr_mask, ip, mask);
+        if (mask < 0 || mask > BITS_TOTAL)
+            throw std::runtime_error("Invalid mask");
+        return this->remove_ip(ip, mask);
+    }
+
+    V query_string(const std::string &addr) const {
+        K ip;
+        int mask;
+        parse_ip<K>(addr, ip, mask);
+        if (mask != -1 && mask != BITS_TOTAL) {
+            throw std::runtime_error("Query with partial mask.");
+        }
+        return this->query(ip);
+    }
+
+    POPCNT_TARGET V query(K ip) const {
+        const Node *table = this->nodes.items.data();
+        const V *results = this->results.items.data();
+
+        const Node *node = &table[0];
+        V matched = def;
+        for (;;) {
+            const uint32_t chunk = ip >> STRIDE_COMPLEMENT;
+
+            /* Longest prefix within the node has the highest bit */
+            const uint32_t internal = node->internal & MATCHING[chunk];
+            if (internal) {
+                const int bit = 31 - __builtin_clz(internal);
+                matched = results[node->result_base + rank(node->internal, bit)];
+            }
+
+            if ((node->external & (1u << chunk)) == 0) {
+                return matched;
+            }
+            node = &table[node->child_base + rank(node->external, chunk)];
+            ip <<= STRIDE;
+        }
+    }
+
+    /**
+     * Query a burst of addresses at once, storing results in out[0..n).
+     * Works like Flat::query_batch, prefetching the next node of each lane.
+     */
+    POPCNT_TARGET void query_batch(const K *ips, V *out, size_t n) const {
+        const Node *table = this->nodes.items.data();
+        const V *results = this->results.items.data();
+
+        struct Lane {
+            const Node *node;
+            K ip;
+            V matched;
+            size_t pos;
+        } lanes[BATCH];
+
+        size_t next = 0;
+        int active = 0;
+        for (; active < BATCH && next < n; active++, next++) {
+            lanes[active] = {table, ips[next], def, next};
+        }
+
+        while (active > 0) {
+            for (int i = 0; i < active;) {
+                Lane &lane = lanes[i];
+                const Node *node = lane.node;
+                const uint32_t chunk = lane.ip >> STRIDE_COMPLEMENT;
+
+                const uint32_t internal = node->internal & MATCHING[chunk];
+                if (internal) {
+                    const int bit = 31 - __builtin_clz(internal);
+                    lane.matched = results[node->result_base
+                                           + rank(node->internal, bit)];
+                }
+
+                if ((node->external & (1u << chunk)) == 0) {
+                    /* Nowhere to run - retire the lane or refill it */
+                    out[lane.pos] = lane.matched;
+                    if (next < n) {
+                        lane = {table, ips[next], def, next};
+                        next++;
+                        i++;
+                    } else {
+                        lane = lanes[--active];
+                    }
+                    continue;
+                }
+
+                lane.node = &table[node->child_base + rank(node->external, chunk)];
+                lane.ip <<= STRIDE;
+                __builtin_prefetch(lane.node);
+                i++;
+            }
+        }
+    }
+
+    /* Nodes in use */
+    int size() const {
+        int released = 0;
+        for (int s = 1; s <= CHILDREN; s++) {
+            released += s * this->nodes.released[s].size();
+        }
+        return this->nodes.items.size() - released;
+    }
+
+    /* Bytes used by node and result tables */
+    size_t memory() const {
+        return (this->nodes.items.capacity() * sizeof(Node)
+                + this->results.items.capacity() * sizeof(V));
+    }
+
+    void debug() {
+        std::cout << "TreeBitmap debug stats:" << std::endl
+                  << "  nodes = " << this->size()
+                  << " of " << sizeof(Node) << "B" << std::endl
+                  << "  results = " << this->results.items.size() << std::endl
+                  << "  memory = " << this->memory() / 1024 << "kB"
+                  << std::endl;
+    }
+};
+
+};
+#endif
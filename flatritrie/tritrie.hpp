@@ -11,11 +11,27 @@
 #include <string>
 #include <bitset>
 #include <cassert>
+#include <utility>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <memory_resource>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+/*
+ * Bitmap compressed queries are all about popcount; make sure it's a single
+ * instruction even when the whole program isn't compiled for a popcnt
+ * capable x86-64.
+ */
+#if defined(__x86_64__) && !defined(__POPCNT__)
+#define POPCNT_TARGET __attribute__((target("popcnt")))
+#else
+#define POPCNT_TARGET
+#endif
+
 namespace Tritrie {
 
 using uint128_t = unsigned __int128;
@@ -35,6 +51,70 @@ static std::ostream &operator<<(std::ostream &os, const uint128_t &data) {
     return os;
 }
 
+/**
+ * Decompose string form of an IP to numerical (host-order) address and mask.
+ * Sets mask to -1 if it's not given.
+ */
+template<typename K>
+void parse_ip(const std::string &addr_mask, K &ip_n, int &mask_n) {
+    constexpr int BITS_TOTAL = (8 * sizeof(K));
+    std::string addr;
+    size_t found = addr_mask.find("/");
+    if (found == std::string::npos) {
+        mask_n = -1;
+        addr = addr_mask;
+    } else {
+        addr = addr_mask.substr(0, found);
+        std::string mask_s = addr_mask.substr(found + 1, addr_mask.size());
+        mask_n = std::stoi(mask_s);
+    }
+
+    if constexpr (BITS_TOTAL == 32) {
+        in_addr ip_parsed;
+        int ret = inet_pton(AF_INET, addr.c_str(), &ip_parsed);
+        if (ret == 0)
+            throw std::runtime_error("Unable to parse IPv4 address");
+
+        ip_n = ntohl(ip_parsed.s_addr);
+    } else if constexpr (BITS_TOTAL == 128) {
+        in6_addr ip_parsed;
+        int ret = inet_pton(AF_INET6, addr.c_str(), &ip_parsed);
+        if (ret == 0)
+            throw std::runtime_error("Unable to parse IPv6 address");
+
+        /* Convert IPv6 to host order, so that bitshifts work ok */
+        ip_n = 0;
+        for (int i=0; i<16; i++) {
+            ip_n |= ((K)ip_parsed.s6_addr[i]) << (120 - 8*i);
+        }
+    } else {
+        throw std::runtime_error("IP Address of unknown lenght");
+    }
+}
+
+/**
+ * Child index of level L taken directly from a network-order address as it
+ * sits in a packet header - BITS bits starting at bit L * BITS. Short last
+ * level is aligned to the top of the index, like with a shifted host-order
+ * key. Everything but the byte reads is known at compile time.
+ */
+template<int BITS, int BITS_TOTAL, int L>
+inline int byte_chunk(const uint8_t *addr) {
+    constexpr int start = L * BITS;
+    constexpr int end = start + BITS < BITS_TOTAL ? start + BITS : BITS_TOTAL;
+    constexpr int width = end - start;
+    constexpr int first = start / 8;
+    constexpr int last = (end - 1) / 8;
+
+    /* BITS <= 8, so the bits span at most two bytes */
+    unsigned window = addr[first];
+    if constexpr (last != first) {
+        window = (window << 8) | addr[last];
+    }
+    const unsigned bits = (window >> ((last + 1) * 8 - end)) & ((1u << width) - 1);
+    return bits << (BITS - width);
+}
+
 /*
  * Trie with a configurable number of branches per level (1 to 8).
  */
@@ -45,6 +125,7 @@ protected:
     constexpr static K MASK_MAX = (K)(-1);
     constexpr static int BITS_TOTAL = (8 * sizeof(K));
     constexpr static int CHILDREN = (1<<BITS);
+    constexpr static int LEVELS = (BITS_TOTAL + BITS - 1) / BITS;
 
     struct Node {
         /* Matched with triplets of bits */
@@ -53,6 +134,9 @@ protected:
         /* 'def' for middle node */
         V value;
 
+        /* Length of the prefix which set the value */
+        uint8_t value_mask = 0;
+
         Node() : value(def) {}
 
         void show() {
@@ -68,44 +152,49 @@ protected:
     Node root;
     int nodes_cnt = 0;
 
-    /* Mask during insertion can only grow or stay the same */
-    int last_mask = 0;
+    /* Longest prefix inserted so far */
+    int max_mask = 0;
+
+    /* Memory of the nodes; NULL when each one is on the heap */
+    std::pmr::memory_resource *const resource = NULL;
 
     Node *get_or_create(Node *cur, const uint8_t tri) {
         if (cur->child[tri] == NULL) {
-            cur->child[tri] = new Node();
+            if (this->resource == NULL) {
+                cur->child[tri] = new Node();
+            } else {
+                void *mem = this->resource->allocate(sizeof(Node), alignof(Node));
+                cur->child[tri] = new (mem) Node();
+            }
             this->nodes_cnt += 1;
         }
         return cur->child[tri];
     }
 
+    /*
+     * Value of a longer prefix is never overwritten by a shorter one, which
+     * expands into the same node - so prefixes can come in any order.
+     */
+    static void set_value(Node *node, int mask, V value) {
+        if (mask >= node->value_mask) {
+            node->value = value;
+            node->value_mask = mask;
+        }
+    }
+
     void add_ip(K ip, int mask, V value) {
         int mask_left = mask;
         Node *cur = &this->root;
-        V cur_value = this->root.value;
-
-        if (mask < this->last_mask) {
-            std::cerr << "Inserting mask " << mask
-                      << " after mask " << this->last_mask << std::endl;
-            throw std::runtime_error("Invalid order of IP insertion to Tritrie");
-        }
 
         assert(BITS_TOTAL > BITS);
-        this->last_mask = mask;
+        this->max_mask = std::max(this->max_mask, mask);
 
         for (; mask_left >= BITS; mask_left -= BITS) {
-            if (value == cur_value) {
-                /* Deduplicate entries with the same value, but on
-                 * different mask levels */
-                return;
-            }
-
             /* Shave "BITS" most significant bits */
             const int tri = ip >> (BITS_TOTAL - BITS);
             ip <<= BITS;
 
             cur = this->get_or_create(cur, tri);
-            cur_value = cur->value;
         }
 
         /* Handle last level appropriately */
@@ -126,26 +215,32 @@ protected:
              * etc.
              * (0xffffffff >> (BITS_TOTAL-mask_left)) << (BITS - mask_left)
              */
-            const K mask = (
+            const K slot_mask = (
                 (MASK_MAX >> (BITS_TOTAL - mask_left)) << (BITS - mask_left)
             );
-            assert(mask != 0);
+            assert(slot_mask != 0);
 
             for (int tri = 0; tri < CHILDREN; tri++) {
-                if ((tri & mask) == ip) {
+                if ((tri & slot_mask) == ip) {
                     /* Insert here */
                     auto lvl = this->get_or_create(cur, tri);
-                    lvl->value = value;
+                    set_value(lvl, mask, value);
                 }
             }
         } else {
             /* After using whole mask, the IP should be 0 */
             assert(ip == 0);
-            cur->value = value;
+            set_value(cur, mask, value);
         }
     }
 
     void release(Node *node) {
+        static_assert(std::is_trivially_destructible<Node>::value,
+                      "Nodes from a resource are never destroyed");
+        if (this->resource != NULL) {
+            /* Nodes are freed all at once, with the resource */
+            return;
+        }
         for (int i = 0; i < CHILDREN; i++) {
             if (node->child[i] != NULL) {
                 release(node->child[i]);
@@ -162,38 +257,25 @@ protected:
      * Sets mask to -1 if it's not given.
      */
     void ip_from_string(const std::string &addr_mask, K &ip_n, int &mask_n) const {
-        std::string addr;
-        size_t found = addr_mask.find("/");
-        if (found == std::string::npos) {
-            mask_n = -1;
-            addr = addr_mask;
-        } else {
-            addr = addr_mask.substr(0, found);
-            std::string mask_s = addr_mask.substr(found + 1, addr_mask.size());
-            mask_n = std::stoi(mask_s);
-        }
+        parse_ip<K>(addr_mask, ip_n, mask_n);
+    }
 
-        if constexpr (BITS_TOTAL == 32) {
-            in_addr ip_parsed;
-            int ret = inet_pton(AF_INET, addr.c_str(), &ip_parsed);
-            if (ret == 0)
-                throw std::runtime_error("Unable to parse IPv4 address");
-
-            ip_n = ntohl(ip_parsed.s_addr);
-        } else if constexpr (BITS_TOTAL == 128) {
-            in6_addr ip_parsed;
-            int ret = inet_pton(AF_INET6, addr.c_str(), &ip_parsed);
-            if (ret == 0)
-                throw std::runtime_error("Unable to parse IPv6 address");
-
-            /* Convert IPv6 to host order, so that bitshifts work ok */
-            ip_n = 0;
-            for (int i=0; i<16; i++) {
-                ip_n |= ((K)ip_parsed.s6_addr[i]) << (120 - 8*i);
+    template<size_t... L>
+    V query_bytes_unrolled(const uint8_t *addr, std::index_sequence<L...>) const {
+        const Node *cur = &this->root;
+        V matched = cur->value;
+        auto step = [&cur, &matched] (int tri) {
+            cur = cur->child[tri];
+            if (cur == NULL) {
+                return false;
             }
-        } else {
-            throw std::runtime_error("IP Address of unknown lenght");
-        }
+            if (cur->value != def) {
+                matched = cur->value;
+            }
+            return true;
+        };
+        (void)(step(byte_chunk<BITS, BITS_TOTAL, L>(addr)) && ...);
+        return matched;
     }
 
     /* Don't copy. */
@@ -201,6 +283,16 @@ protected:
 
 public:
     Tritrie() {}
+
+    /**
+     * Tritrie with nodes taken from a memory resource, which has to outlive
+     * it. Nodes are never given back one by one - a bump allocator like
+     * std::pmr::monotonic_buffer_resource builds fast, keeps nodes close
+     * and frees them all at once.
+     */
+    explicit Tritrie(std::pmr::memory_resource *resource)
+        : resource(resource) {}
+
     ~Tritrie() {
         this->release(&this->root);
     }
@@ -213,6 +305,11 @@ public:
             throw std::runtime_error("Address without a mask");
         }
 
+        this->add(ip, mask, value);
+    }
+
+    /* Add a numerical (host-order) network */
+    void add(K ip, int mask, V value) {
         assert(mask >= 0 && mask <= BITS_TOTAL);
         if (mask < 0 || mask > BITS_TOTAL)
             throw std::exception();
@@ -248,11 +345,29 @@ public:
         return matched;
     }
 
+    /**
+     * Query by a network-order address (4 or 16 bytes, depending on K), as
+     * it is in the IP header. No byte swapping nor key assembly is done.
+     */
+    V query_bytes(const uint8_t *addr) const {
+        return this->query_bytes_unrolled(addr, std::make_index_sequence<LEVELS>());
+    }
+
     int size() const {
         return this->nodes_cnt;
     }
 
+    /* Length of the longest inserted prefix */
+    int longest_mask() const {
+        return this->max_mask;
+    }
+
     template<int B, typename TK, typename TV, TV tdef, int PAGE_SIZE> friend class Flat;
+    template<int B, typename TK, typename TV, TV tdef> friend class FlatIdx;
+    template<int B, typename TK, typename TV, TV tdef, int PAGE_SIZE> friend class FlatLeaf;
+    template<typename TK, typename TV, TV tdef> friend class Poptrie;
+    template<int S, typename TK, typename TV, TV tdef> friend class TreeBitmap;
+    template<int B, typename TK, typename TV, TV tdef> friend class FlatSkip;
 };
 
 };
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2019 Tomasz bla Fortuna. All rights reserved.
+ * License: MIT
+ *
+ * Choose FlatStrides levels for a prefix set within a memory budget, then
+ * build the table and query it.
+ *
+ * Usage: stride_optimizer [prefixes.txt | GeoLite2-Blocks.csv] [budget MB]
+ */
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <charconv>
+
+#include "tritrie.hpp"
+#include "flatstrides.hpp"
+#include "strideopt.hpp"
+#include "utils.hpp"
+
+template<typename K>
+int optimize(std::vector<std::string> &data, size_t budget) {
+    Tritrie::StrideOptimizer<K> optimizer;
+    for (auto &item: data) {
+        optimizer.add(item);
+    }
+
+    std::cout << "Prefix length histogram of " << optimizer.size()
+              << " networks:" << std::endl;
+    const auto histogram = optimizer.histogram();
+    for (size_t mask = 0; mask < histogram.size(); mask++) {
+        if (histogram[mask] > 0) {
+            std::cout << "  /" << mask << " " << histogram[mask] << std::endl;
+        }
+    }
+
+    using Table = Tritrie::FlatStridesDyn<K>;
+    std::vector<int> strides;
+    try {
+        measure("Stride optimization",
+                [&] () {
+                    strides = optimizer.optimize(budget, Table::SLOT_BYTES);
+                });
+    } catch (std::runtime_error &error) {
+        std::cout << error.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Strides:";
+    for (int stride: strides) {
+        std::cout << " " << stride;
+    }
+    std::cout << std::endl
+              << "Estimated memory: "
+              << optimizer.cost(strides, Table::SLOT_BYTES) / 1024 << "kB"
+              << std::endl;
+
+    Table table(strides);
+    table.reserve(optimizer.nodes());
+    test_generation("FlatStridesDyn", table, data);
+    table.debug();
+    if (table.memory() > budget) {
+        std::cout << "Table doesn't fit in the budget" << std::endl;
+        return 1;
+    }
+
+    if constexpr (std::numeric_limits<K>::digits == 32) {
+        const auto queries = get_rnd_test_data(data);
+        const int queries_cnt = queries.size();
+        test_query("Positive random query test",
+                   table,
+                   [&queries, queries_cnt] (int i) {
+                       return queries[i % queries_cnt];
+                   });
+    } else {
+        const auto queries = get_rnd_test_data_v6(data);
+        const int queries_cnt = queries.size();
+        test_query("Positive random query test",
+                   table,
+                   [&queries, queries_cnt] (int i) {
+                       return queries[i % queries_cnt];
+                   });
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const std::string path = argc > 1 ? argv[1] : "test_data.txt";
+    const size_t budget = (argc > 2 ? std::stoul(argv[2]) : 64) * 1024 * 1024;
+
+    auto data = load_data(path);
+    if (data.empty()) {
+        std::cout << "No networks in " << path << std::endl;
+        return 1;
+    }
+
+    std::cout << "Budget " << budget / 1024 / 1024 << "MB" << std::endl;
+    if (data[0].find(':') != std::string::npos) {
+        return optimize<Tritrie::uint128_t>(data, budget);
+    }
+    return optimize<uint32_t>(data, budget);
+}
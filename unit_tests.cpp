@@ -11,6 +11,19 @@
 #include "tritrie.hpp"
 #include "flatritrie.hpp"
 #include "multitritrie.hpp"
+#include "flatidx.hpp"
+#include "flatleaf.hpp"
+#include "flatskip.hpp"
+#include "flatstrides.hpp"
+#include "strideopt.hpp"
+#include "dir24.hpp"
+#include "poptrie.hpp"
+#include "treebitmap.hpp"
+#include "flatimage.hpp"
+#include "replicated.hpp"
+#include "hash48.hpp"
+#include "dualstack.hpp"
+#include "tablehandle.hpp"
 #include "hashmap.hpp"
 
 namespace Test {
@@ -135,6 +148,8 @@ const std::vector<std::pair<std::string, int>> testcases_v6 = {
     {"2001:470:1f0b:a9:9dc3:6ed8:e819:f89a", 40},
     {"2001:470:1f0b:a9:9dc3:6ed8:e819:f89b", -2},
     {"2001:470:1f0b:a9:9dc3:6ed8:e819:f899", -2},
+    /* Diverges in the middle of a single-child chain */
+    {"2001:470:1f0b:a9:9dc3::", -2},
     {"2002:470:1f0b:a9:9dc3:6ed8:e819:f89a", -2},
 };
 
@@ -160,6 +175,102 @@ int runner(T &algo, K &testcases) {
     return failures;
 }
 
+/* Parse IPv4 testcase address to host-order */
+uint32_t ipv4(const std::string &addr) {
+    in_addr ip_parsed;
+    inet_aton(addr.c_str(), &ip_parsed);
+    return ntohl(ip_parsed.s_addr);
+}
+
+/* Parse testcase address to network-order bytes, as in an IP header */
+std::vector<uint8_t> network_bytes(const std::string &addr_mask) {
+    /* Full mask is allowed in the testcases */
+    const std::string addr = addr_mask.substr(0, addr_mask.find('/'));
+    std::vector<uint8_t> bytes(16);
+    if (inet_pton(AF_INET, addr.c_str(), bytes.data()) == 1) {
+        bytes.resize(4);
+    } else if (inet_pton(AF_INET6, addr.c_str(), bytes.data()) != 1) {
+        throw std::runtime_error("Unable to parse testcase address");
+    }
+    return bytes;
+}
+
+/* Networks of the testcase data as numeric prefixes, in reverse order */
+template<typename K, typename V>
+std::vector<Tritrie::Prefix<K, V>> prefixes(
+    const std::vector<std::pair<std::string, int>> &data) {
+    std::vector<Tritrie::Prefix<K, V>> numeric;
+    for (auto item = data.rbegin(); item != data.rend(); item++) {
+        K ip;
+        int mask;
+        Tritrie::parse_ip<K>(item->first, ip, mask);
+        numeric.push_back({ip, (uint8_t)mask, (V)item->second});
+    }
+    return numeric;
+}
+
+/* Same testcases, queried by network-order bytes */
+template<typename T, typename K>
+int runner_bytes(T &algo, K &testcases) {
+    int successes = 0;
+    int failures = 0;
+    for (auto &testcase: testcases) {
+        const auto bytes = network_bytes(testcase.first);
+        int ret = algo.query_bytes(bytes.data());
+        if (ret != testcase.second) {
+            std::cout << "TEST FAIL (bytes) " << testcase.first
+                      << " returned " << ret << " should "
+                      << testcase.second
+                      << std::endl;
+            failures += 1;
+        } else {
+            successes += 1;
+        }
+    };
+    std::cout << "TESTS: OK=" << successes << " FAILED="
+              << failures << std::endl;
+    std::cout << std::endl;
+    return failures;
+}
+
+/* Same testcases, but all queried in a single burst */
+template<typename K, typename Fn>
+int runner_burst(K &testcases, Fn query_burst) {
+    int successes = 0;
+    int failures = 0;
+    std::vector<uint32_t> ips;
+    for (auto &testcase: testcases) {
+        ips.push_back(ipv4(testcase.first));
+    }
+
+    std::vector<int32_t> results(ips.size());
+    query_burst(ips.data(), results.data(), ips.size());
+
+    for (size_t i = 0; i < testcases.size(); i++) {
+        if (results[i] != testcases[i].second) {
+            std::cout << "TEST FAIL (batch) " << testcases[i].first
+                      << " returned " << results[i] << " should "
+                      << testcases[i].second
+                      << std::endl;
+            failures += 1;
+        } else {
+            successes += 1;
+        }
+    }
+    std::cout << "TESTS: OK=" << successes << " FAILED="
+              << failures << std::endl;
+    std::cout << std::endl;
+    return failures;
+}
+
+template<typename T, typename K>
+int runner_batch(T &algo, K &testcases) {
+    return runner_burst(testcases,
+                        [&algo] (const uint32_t *ips, int32_t *out, size_t n) {
+                            algo.query_batch(ips, out, n);
+                        });
+}
+
 template <typename T, typename M, typename K>
 int runner_multi(T &algo, M &testcases_m, K &testcases) {
     int successes = 0;
@@ -206,6 +317,212 @@ int testcase_map() {
     return ret;
 }
 
+int testcase_dir24() {
+    Tritrie::Dir24<> dir;
+    for (auto &item: Test::data_v4) {
+        dir.add(item.first, item.second);
+    }
+
+    std::cout << "Dir24 testcases" << std::endl;
+    int ret = Test::runner<>(dir, Test::testcases_v4);
+
+    /* Error handling */
+    try {
+        dir.add("8.8.8.0/16", 100); /* Throws exception */
+        std::cout << "Ordering error" << std::endl;
+        ret += 1;
+    } catch(std::runtime_error &re) {
+    }
+    try {
+        dir.add("8.8.8.0/32", 1 << 30); /* Doesn't fit in 31 bits */
+        std::cout << "Value range error" << std::endl;
+        ret += 1;
+    } catch(std::runtime_error &re) {
+    }
+
+    /* Values stored in slots keep their sign */
+    const std::vector<std::pair<std::string, int>> testcases_signed = {
+        {"10.1.0.0", -(1 << 30)},
+        {"10.1.0.5", -2},
+        {"10.2.0.0", (1 << 30) - 1},
+    };
+    Tritrie::Dir24<int32_t, -1> dir_signed;
+    dir_signed.add("10.1.0.0/16", -(1 << 30));
+    dir_signed.add("10.2.0.0/16", (1 << 30) - 1);
+    dir_signed.add("10.1.0.4/30", -2);
+    ret += Test::runner<>(dir_signed, testcases_signed);
+
+    /* Wider values go through the value table */
+    Tritrie::Dir24<int64_t, -1> dir_wide;
+    for (auto &item: Test::data_v4) {
+        dir_wide.add(item.first, item.second);
+    }
+    std::cout << "Dir24 int64_t testcases" << std::endl;
+    ret += Test::runner<>(dir_wide, Test::testcases_v4);
+    return ret;
+}
+
+int testcase_poptrie() {
+    int ret = 0;
+    Tritrie::Tritrie<6> tritrie;
+    for (auto &item: Test::data_v4) {
+        tritrie.add(item.first, item.second);
+    }
+    Tritrie::Poptrie<> poptrie;
+    poptrie.build(tritrie);
+    std::cout << "Poptrie testcases" << std::endl;
+    ret += Test::runner<>(poptrie, Test::testcases_v4);
+
+    Tritrie::Tritrie<6, Tritrie::uint128_t, int32_t, -500> tritrie_v6;
+    for (auto &item: Test::data_v6) {
+        tritrie_v6.add(item.first, item.second);
+    }
+    Tritrie::Poptrie<Tritrie::uint128_t, int32_t, -500> poptrie_v6;
+    poptrie_v6.build(tritrie_v6);
+    std::cout << "Poptrie IPv6 testcases" << std::endl;
+    ret += Test::runner<>(poptrie_v6, Test::testcases_v6);
+    return ret;
+}
+
+int testcase_treebitmap() {
+    int ret = 0;
+
+    /* Prefixes can come in any order */
+    Tritrie::TreeBitmap<> tree;
+    for (auto item = Test::data_v4.rbegin(); item != Test::data_v4.rend(); item++) {
+        tree.add(item->first, item->second);
+    }
+    std::cout << "TreeBitmap<4> testcases" << std::endl;
+    ret += Test::runner<>(tree, Test::testcases_v4);
+    ret += Test::runner_batch<>(tree, Test::testcases_v4);
+
+    /* Removal falls back to the shorter prefix */
+    if (!tree.remove("10.255.0.3/32") or tree.remove("10.255.0.3/32")) {
+        std::cout << "Remove error" << std::endl;
+        ret += 1;
+    }
+    auto removed = Test::testcases_v4;
+    for (auto &testcase: removed) {
+        if (testcase.first == "10.255.0.3") {
+            testcase.second = 2;
+        }
+    }
+    std::cout << "TreeBitmap<4> after remove" << std::endl;
+    ret += Test::runner<>(tree, removed);
+
+    /* Removing everything leaves only the root */
+    for (auto &item: Test::data_v4) {
+        tree.remove(item.first);
+    }
+    if (tree.size() != 1) {
+        std::cout << "Nodes left after removal: " << tree.size() << std::endl;
+        ret += 1;
+    }
+
+    /* Built from Tritrie with a short last level */
+    Tritrie::Tritrie<5> tritrie;
+    for (auto &item: Test::data_v4) {
+        tritrie.add(item.first, item.second);
+    }
+    Tritrie::TreeBitmap<5> tree5;
+    tree5.build(tritrie);
+    std::cout << "TreeBitmap<5> from Tritrie testcases" << std::endl;
+    ret += Test::runner<>(tree5, Test::testcases_v4);
+
+    Tritrie::TreeBitmap<4, Tritrie::uint128_t, int32_t, -500> tree_v6;
+    for (auto &item: Test::data_v6) {
+        tree_v6.add(item.first, item.second);
+    }
+    std::cout << "TreeBitmap IPv6 testcases" << std::endl;
+    ret += Test::runner<>(tree_v6, Test::testcases_v6);
+    return ret;
+}
+
+int testcase_replicated() {
+    Tritrie::Tritrie<6> tritrie;
+    for (auto &item: Test::data_v4) {
+        tritrie.add(item.first, item.second);
+    }
+
+    Tritrie::Replicated<Tritrie::Flat<6>> replicated;
+    replicated.build([&tritrie] (Tritrie::Flat<6> &flat) {
+        flat.build(tritrie);
+    });
+    std::cout << "Replicated Flat<6> testcases, "
+              << replicated.nodes() << " replicas" << std::endl;
+    int ret = Test::runner<>(replicated, Test::testcases_v4);
+
+    /* From another thread, with its own local replica */
+    std::thread reader([&] () {
+        for (int node = 0; node < replicated.nodes(); node++) {
+            ret += Test::runner<>(replicated.replica(node), Test::testcases_v4);
+        }
+    });
+    reader.join();
+
+    /* Memory policy bound to the nodes */
+    replicated.build([&tritrie] (Tritrie::Flat<6> &flat) {
+        flat.build(tritrie);
+    }, Tritrie::Placement::BIND);
+    std::cout << "Replicated Flat<6> bound to nodes" << std::endl;
+    ret += Test::runner<>(replicated, Test::testcases_v4);
+    return ret;
+}
+
+int testcase_tablehandle() {
+    using Table = Tritrie::Flat<6>;
+    const auto prefixes = Test::prefixes<uint32_t, int32_t>(Test::data_v4);
+
+    /* Second version of the data has all values shifted */
+    std::atomic<int> shift(0);
+    Tritrie::TableHandle<Table> handle([&] (Table &table) {
+        auto shifted = prefixes;
+        for (auto &prefix: shifted) {
+            prefix.value += shift;
+        }
+        table.build(shifted.data(), shifted.size());
+    });
+    Tritrie::TableHandle<Table>::Reader reader(handle);
+    std::cout << "TableHandle Flat<6> testcases" << std::endl;
+    int ret = Test::runner<>(reader, Test::testcases_v4);
+
+    /* Table swapped during a query is freed after it */
+    reader.with([&] (const Table &) {
+        handle.reload();
+        if (handle.reclaim() != 1) {
+            std::cout << "TEST FAIL table freed during a query" << std::endl;
+            ret += 1;
+        }
+        return 0;
+    });
+    if (handle.reclaim() != 0) {
+        std::cout << "TEST FAIL table not freed after a query" << std::endl;
+        ret += 1;
+    }
+
+    /* Background reload on a file change */
+    const std::string path = "/tmp/flatritrie_tablehandle.txt";
+    std::ofstream(path) << "1";
+    handle.watch(path, std::chrono::milliseconds(10));
+    shift = 100;
+    const int generations = handle.generations();
+    std::ofstream(path) << "10";
+    for (int i = 0; i < 500 and handle.generations() == generations; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::remove(path.c_str());
+
+    auto testcases_shifted = Test::testcases_v4;
+    for (auto &testcase: testcases_shifted) {
+        if (testcase.second != -1) {
+            testcase.second += 100;
+        }
+    }
+    std::cout << "TableHandle Flat<6> testcases after a file change" << std::endl;
+    ret += Test::runner<>(reader, testcases_shifted);
+    return ret;
+}
+
 int testcase_trie() {
     int ret;
     Trie trie;
@@ -243,20 +560,226 @@ int testcase_tritrie() {
 
     std::cout << "Testing tritrie<" << BITS << ">" << std::endl;
     ret += Test::runner<>(tritrie, Test::testcases_v4);
+    ret += Test::runner_bytes<>(tritrie, Test::testcases_v4);
 
     std::cout << "Testing multitritrie<" << BITS << ">" << std::endl;
     ret += Test::runner<>(multi_tritrie, Test::testcases_v4);
     ret += Test::runner_multi<>(multi_tritrie, Test::testcases_multi_v4,
                                 Test::testcases_v4);
 
+    /* Longest prefixes first */
+    Tritrie::Tritrie<BITS> tritrie_rev;
+    Tritrie::MultiTritrie<BITS> multi_tritrie_rev;
+    for (auto item = Test::data_v4.rbegin(); item != Test::data_v4.rend(); item++) {
+        tritrie_rev.add(item->first, item->second);
+        multi_tritrie_rev.add(item->first, item->second);
+    }
+    std::cout << "Testing reversed tritrie<" << BITS << "> and multitritrie" << std::endl;
+    ret += Test::runner<>(tritrie_rev, Test::testcases_v4);
+    ret += Test::runner<>(multi_tritrie_rev, Test::testcases_v4);
+    ret += Test::runner_multi<>(multi_tritrie_rev, Test::testcases_multi_v4,
+                                Test::testcases_v4);
+
+    /* Nodes from a bump allocator */
+    std::pmr::monotonic_buffer_resource arena;
+    Tritrie::Tritrie<BITS> tritrie_arena(&arena);
+    Tritrie::MultiTritrie<BITS> multi_tritrie_arena(&arena);
+    for (auto &item: Test::data_v4) {
+        tritrie_arena.add(item.first, item.second);
+        multi_tritrie_arena.add(item.first, item.second);
+    }
+    std::cout << "Testing tritrie<" << BITS << "> and multitritrie on an arena" << std::endl;
+    ret += Test::runner<>(tritrie_arena, Test::testcases_v4);
+    ret += Test::runner_multi<>(multi_tritrie_arena, Test::testcases_multi_v4,
+                                Test::testcases_v4);
+
+    /* Same value again below a different one must not be dropped */
+    Tritrie::Tritrie<BITS> tritrie_nested;
+    tritrie_nested.add("10.0.0.0/8", 1);
+    tritrie_nested.add("10.1.0.0/16", 2);
+    tritrie_nested.add("10.1.1.0/24", 1);
+    const std::vector<std::pair<std::string, int>> testcases_nested = {
+        {"10.0.0.1", 1},
+        {"10.1.0.1", 2},
+        {"10.1.1.1", 1},
+    };
+    ret += Test::runner<>(tritrie_nested, testcases_nested);
+
     /* FlaTritrie test */
     Tritrie::Flat<BITS> flatritrie;
     flatritrie.build(tritrie);
     std::cout << "Testing flatritrie<" << BITS << ">" << std::endl;
     ret += Test::runner<>(flatritrie, Test::testcases_v4);
+    ret += Test::runner_batch<>(flatritrie, Test::testcases_v4);
+    ret += Test::runner_bytes<>(flatritrie, Test::testcases_v4);
 
-    /* Should build second time as well */
-    flatritrie.build(tritrie);
+    /* Burst of pointers into the "headers" */
+    std::vector<std::vector<uint8_t>> headers;
+    std::vector<const uint8_t *> addrs;
+    for (auto &testcase: Test::testcases_v4) {
+        headers.push_back(Test::network_bytes(testcase.first));
+    }
+    for (auto &header: headers) {
+        addrs.push_back(header.data());
+    }
+    std::vector<int32_t> results(addrs.size());
+    flatritrie.query_bytes_burst(addrs.data(), results.data(), addrs.size());
+    for (size_t i = 0; i < addrs.size(); i++) {
+        if (results[i] != Test::testcases_v4[i].second) {
+            std::cout << "TEST FAIL (bytes burst) " << Test::testcases_v4[i].first
+                      << " returned " << results[i] << std::endl;
+            ret += 1;
+        }
+    }
+
+    /* Direct build gives the same table */
+    const auto prefixes = Test::prefixes<uint32_t, int32_t>(Test::data_v4);
+    Tritrie::Flat<BITS> flat_direct;
+    flat_direct.build(prefixes.data(), prefixes.size());
+    std::cout << "Testing flatritrie<" << BITS << "> direct build" << std::endl;
+    ret += Test::runner<>(flat_direct, Test::testcases_v4);
+    if (flat_direct.size() != flatritrie.size()) {
+        std::cout << "TEST FAIL direct build has " << flat_direct.size()
+                  << " entries instead of " << flatritrie.size() << std::endl;
+        ret += 1;
+    }
+    flat_direct.build(prefixes.data(), prefixes.size(), 4);
+    std::cout << "Testing flatritrie<" << BITS << "> parallel build" << std::endl;
+    ret += Test::runner<>(flat_direct, Test::testcases_v4);
+
+    /* Networks expanded within the root, Tritrie is the reference */
+    auto data_short = Test::data_v4;
+    data_short.push_back({"0.0.0.0/0", 10});
+    data_short.push_back({"64.0.0.0/2", 11});
+    data_short.push_back({"8.0.0.0/5", 12});
+    Tritrie::Tritrie<BITS> tritrie_short;
+    for (auto &item: data_short) {
+        tritrie_short.add(item.first, item.second);
+    }
+    auto testcases_short = Test::testcases_v4;
+    testcases_short.push_back({"100.0.0.1", 0});
+    testcases_short.push_back({"12.0.0.1", 0});
+    for (auto &testcase: testcases_short) {
+        testcase.second = tritrie_short.query_string(testcase.first);
+    }
+    const auto prefixes_short = Test::prefixes<uint32_t, int32_t>(data_short);
+    flat_direct.build(prefixes_short.data(), prefixes_short.size(), 4);
+    std::cout << "Testing flatritrie<" << BITS << "> parallel build with short networks"
+              << std::endl;
+    ret += Test::runner<>(flat_direct, testcases_short);
+
+    /* Should build second time as well, with each layout */
+    for (auto layout: {Tritrie::Layout::BFS, Tritrie::Layout::PAGE}) {
+        flatritrie.build(tritrie, layout);
+        std::cout << "Testing flatritrie<" << BITS << "> layout "
+                  << (int)layout << std::endl;
+        ret += Test::runner<>(flatritrie, Test::testcases_v4);
+    }
+
+    /* Huge page backed, pre-faulted */
+    Tritrie::Flat<BITS> flat_huge(Tritrie::Backing::HUGEPAGE, true);
+    flat_huge.build(tritrie, Tritrie::Layout::PAGE);
+    flat_huge.warm();
+    std::cout << "Testing flatritrie<" << BITS << "> on huge pages" << std::endl;
+    ret += Test::runner<>(flat_huge, Test::testcases_v4);
+
+    /* Position independent image, queried from the mapped file */
+    const std::string image_path = "/tmp/flatritrie_test.img";
+    flat_huge.save(image_path);
+    Tritrie::FlatImage<BITS> image;
+    image.open_mmap(image_path);
+    std::cout << "Testing flatimage<" << BITS << "> from Flat" << std::endl;
+    ret += Test::runner<>(image, Test::testcases_v4);
+
+    /* Relayout by profile of testcase queries should not change results */
+    typename Tritrie::Flat<BITS>::Profile profile;
+    for (auto &testcase: Test::testcases_v4) {
+        flatritrie.record(Test::ipv4(testcase.first), profile);
+    }
+    flatritrie.relayout(profile);
+    std::cout << "Testing flatritrie<" << BITS << "> relayout" << std::endl;
+    ret += Test::runner<>(flatritrie, Test::testcases_v4);
+
+    /* Index encoded variant */
+    Tritrie::FlatIdx<BITS> flatidx;
+    flatidx.build(tritrie);
+    std::cout << "Testing flatidx<" << BITS << ">" << std::endl;
+    ret += Test::runner<>(flatidx, Test::testcases_v4);
+    ret += Test::runner_batch<>(flatidx, Test::testcases_v4);
+
+    /* Same image format */
+    flatidx.save(image_path);
+    image.open_mmap(image_path);
+    std::cout << "Testing flatimage<" << BITS << "> from FlatIdx" << std::endl;
+    ret += Test::runner<>(image, Test::testcases_v4);
+
+    /* Type mismatch or corruption is detected */
+    try {
+        Tritrie::FlatImage<BITS, uint32_t, int64_t, -1> wrong;
+        wrong.open_mmap(image_path);
+        std::cout << "Image type check error" << std::endl;
+        ret += 1;
+    } catch(std::runtime_error &re) {
+    }
+    {
+        std::fstream corrupt(image_path, std::ios::in | std::ios::out | std::ios::binary);
+        corrupt.seekp(sizeof(Tritrie::ImageHeader) + 4);
+        corrupt.put(0x7f);
+    }
+    try {
+        image.open_mmap(image_path);
+        std::cout << "Image checksum error" << std::endl;
+        ret += 1;
+    } catch(std::runtime_error &re) {
+    }
+
+    /* Out of range child is rejected, or not followed without verification */
+    {
+        std::fstream corrupt(image_path, std::ios::in | std::ios::out | std::ios::binary);
+        corrupt.seekp(sizeof(Tritrie::ImageHeader));
+        const uint32_t child = 0xffffffff;
+        corrupt.write((const char *)&child, sizeof(child));
+    }
+    try {
+        image.open_mmap(image_path);
+        std::cout << "Image child index error" << std::endl;
+        ret += 1;
+    } catch(std::runtime_error &re) {
+    }
+    image.open_mmap(image_path, false);
+    image.query(0);
+
+    /* Child cycle doesn't hang the query */
+    {
+        std::fstream corrupt(image_path, std::ios::in | std::ios::out | std::ios::binary);
+        const uint32_t child = 1;
+        /* Root and entry 1 rows point to entry 1 */
+        corrupt.seekp(sizeof(Tritrie::ImageHeader));
+        for (int slot = 0; slot < 2 * (1<<BITS); slot++) {
+            corrupt.write((const char *)&child, sizeof(child));
+        }
+    }
+    image.open_mmap(image_path, false);
+    image.query(0);
+    std::remove(image_path.c_str());
+    std::cout << "Testing flatidx<" << BITS << "> SIMD" << std::endl;
+    ret += Test::runner_burst(
+        Test::testcases_v4,
+        [&flatidx] (const uint32_t *ips, int32_t *out, size_t n) {
+            flatidx.query_simd(ips, out, n);
+        });
+
+    /* Leaf-pushed variant */
+    Tritrie::FlatLeaf<BITS> flatleaf;
+    flatleaf.build(tritrie);
+    std::cout << "Testing flatleaf<" << BITS << ">" << std::endl;
+    ret += Test::runner<>(flatleaf, Test::testcases_v4);
+
+    /* Path compressed variant */
+    Tritrie::FlatSkip<BITS> flatskip;
+    flatskip.build(tritrie);
+    std::cout << "Testing flatskip<" << BITS << ">" << std::endl;
+    ret += Test::runner<>(flatskip, Test::testcases_v4);
 
     /* Error handling */
     try {
@@ -281,7 +804,226 @@ int testcase_ipv6() {
     }
 
     ret += Test::runner<>(tritrie, Test::testcases_v6);
+    ret += Test::runner_bytes<>(tritrie, Test::testcases_v6);
+
+    Tritrie::Flat<BITS, Tritrie::uint128_t, int32_t, -500> flatritrie;
+    flatritrie.build(tritrie);
+    std::cout << "Testing flatritrie<" << BITS << "> for IPv6" << std::endl;
+    ret += Test::runner<>(flatritrie, Test::testcases_v6);
+    ret += Test::runner_bytes<>(flatritrie, Test::testcases_v6);
+
+    const auto prefixes = Test::prefixes<Tritrie::uint128_t, int32_t>(Test::data_v6);
+    Tritrie::Flat<BITS, Tritrie::uint128_t, int32_t, -500> flat_direct;
+    flat_direct.build(prefixes.data(), prefixes.size());
+    std::cout << "Testing flatritrie<" << BITS << "> for IPv6 direct build" << std::endl;
+    ret += Test::runner<>(flat_direct, Test::testcases_v6);
+    if (flat_direct.size() != flatritrie.size()) {
+        std::cout << "TEST FAIL direct build has " << flat_direct.size()
+                  << " entries instead of " << flatritrie.size() << std::endl;
+        ret += 1;
+    }
+    flat_direct.build(prefixes.data(), prefixes.size(), 4);
+    std::cout << "Testing flatritrie<" << BITS << "> for IPv6 parallel build" << std::endl;
+    ret += Test::runner<>(flat_direct, Test::testcases_v6);
+
+    Tritrie::FlatSkip<BITS, Tritrie::uint128_t, int32_t, -500> flatskip;
+    flatskip.build(tritrie);
+    std::cout << "Testing flatskip<" << BITS << "> for IPv6" << std::endl;
+    ret += Test::runner<>(flatskip, Test::testcases_v6);
+
+    Tritrie::FlatLeaf<BITS, Tritrie::uint128_t, int32_t, -500> flatleaf;
+    flatleaf.build(tritrie);
+    std::cout << "Testing flatleaf<" << BITS << "> for IPv6" << std::endl;
+    ret += Test::runner<>(flatleaf, Test::testcases_v6);
+
+    Tritrie::FlatIdx<BITS, Tritrie::uint128_t, int32_t, -500> flatidx;
+    flatidx.build(tritrie);
+    std::cout << "Testing flatidx<" << BITS << "> for IPv6" << std::endl;
+    ret += Test::runner<>(flatidx, Test::testcases_v6);
+    try {
+        flatidx.query_string("2001:200::/32");
+        std::cout << "Partial mask error" << std::endl;
+        ret += 1;
+    } catch(std::runtime_error &re) {
+    }
+
+    Tritrie::Hash48<BITS, int32_t, -500> hash48;
+    hash48.build(tritrie);
+    std::cout << "Testing hash48<" << BITS << ">" << std::endl;
+    ret += Test::runner<>(hash48, Test::testcases_v6);
+
+    /* Only prefixes up to /64 - query stops after the high half */
+    Tritrie::Tritrie<BITS, Tritrie::uint128_t, int32_t, -500> tritrie_64;
+    for (auto &item: Test::data_v6) {
+        if (std::stoi(item.first.substr(item.first.find('/') + 1)) <= 64) {
+            tritrie_64.add(item.first, item.second);
+        }
+    }
+    Tritrie::Flat<BITS, Tritrie::uint128_t, int32_t, -500> flat_64;
+    flat_64.build(tritrie_64);
+
+    /* Tritrie is the reference */
+    auto testcases_64 = Test::testcases_v6;
+    for (auto &testcase: testcases_64) {
+        testcase.second = tritrie_64.query_string(testcase.first);
+    }
+    std::cout << "Testing flatritrie<" << BITS << "> for IPv6 up to /64" << std::endl;
+    ret += Test::runner<>(flat_64, testcases_64);
+
+    Tritrie::Hash48<BITS, int32_t, -500> hash48_64;
+    hash48_64.build(tritrie_64);
+    std::cout << "Testing hash48<" << BITS << "> for IPv6 up to /64" << std::endl;
+    ret += Test::runner<>(hash48_64, testcases_64);
+
+    return ret;
+}
+
+template<int BITS>
+int testcase_dualstack() {
+    using DualStack = Tritrie::DualStack<BITS>;
+
+    /* Families interleaved, in no particular order */
+    std::vector<std::pair<std::string, int>> data;
+    for (size_t i = 0; i < std::max(Test::data_v4.size(), Test::data_v6.size()); i++) {
+        if (i < Test::data_v6.size()) {
+            data.push_back(Test::data_v6[Test::data_v6.size() - 1 - i]);
+        }
+        if (i < Test::data_v4.size()) {
+            data.push_back(Test::data_v4[i]);
+        }
+    }
+
+    DualStack dualstack;
+    std::cout << "Generating dualstack<" << BITS << ">" << std::endl;
+    for (auto &item: data) {
+        dualstack.add(item.first, item.second);
+    }
+    dualstack.build();
+
+    int ret = 0;
+    ret += Test::runner<>(dualstack, Test::testcases_v4);
+    ret += Test::runner<>(dualstack, Test::testcases_v6);
+
+    /* IPv4-mapped IPv6 queries land in the same subtree */
+    const std::vector<std::pair<std::string, int>> testcases_mapped = {
+        {"::ffff:10.255.0.3", 3},
+        {"::ffff:170.85.202.7", 7},
+        {"::ffff:254.0.0.0", -2},
+    };
+    ret += Test::runner<>(dualstack, testcases_mapped);
+
+    /* Without IPv4 networks */
+    DualStack v6_only;
+    for (auto &item: Test::data_v6) {
+        v6_only.add(item.first, item.second);
+    }
+    v6_only.build();
+    ret += Test::runner<>(v6_only, Test::testcases_v6);
+    const std::vector<std::pair<std::string, int>> testcases_no_v4 = {
+        {"10.255.0.3", -1},
+    };
+    ret += Test::runner<>(v6_only, testcases_no_v4);
+
+    /* IPv6 network expanded into the IPv4 subtree root doesn't match IPv4 */
+    DualStack covering;
+    covering.add("::fffe:0:0/95", 50);
+    covering.add("10.0.0.0/8", 51);
+    covering.build();
+    const std::vector<std::pair<std::string, int>> testcases_covering = {
+        {"::ffff:1.2.3.4", 50},
+        {"1.2.3.4", -1},
+        {"10.1.2.3", 51},
+    };
+    ret += Test::runner<>(covering, testcases_covering);
+
+    /* But 0.0.0.0/0 does */
+    DualStack with_default;
+    with_default.add("::fffe:0:0/95", 50);
+    with_default.add("0.0.0.0/0", 52);
+    with_default.build();
+    const std::vector<std::pair<std::string, int>> testcases_default = {
+        {"::ffff:1.2.3.4", 52},
+        {"1.2.3.4", 52},
+        {"10.1.2.3", 52},
+    };
+    ret += Test::runner<>(with_default, testcases_default);
 
+    /* Error handling */
+    try {
+        with_default.add("10.0.0.0/8", 53); /* Throws exception */
+        std::cout << "Add after build error" << std::endl;
+        ret += 1;
+    } catch(std::runtime_error &re) {
+    }
+    for (const std::string network: {"1.2.3.0/-5", "1.2.3.0/33", "2001::/129"}) {
+        try {
+            DualStack invalid;
+            invalid.add(network, 54); /* Throws exception */
+            std::cout << "Mask range error for " << network << std::endl;
+            ret += 1;
+        } catch(std::runtime_error &re) {
+        }
+    }
+    return ret;
+}
+
+template<typename T, typename D, typename C>
+int testcase_strides(const std::string &name, const D &data, const C &testcases) {
+    T flat;
+    std::cout << "Generating flatstrides" << name << std::endl;
+    for (auto &item: data) {
+        flat.add(item.first, item.second);
+    }
+    return Test::runner<>(flat, testcases);
+}
+
+template<typename K, typename V, V def, typename D, typename C>
+int testcase_strideopt(const std::string &name, const D &data, const C &testcases) {
+    using Table = Tritrie::FlatStridesDyn<K, V, def>;
+    constexpr int BITS_TOTAL = std::numeric_limits<K>::digits;
+    int ret = 0;
+
+    Tritrie::StrideOptimizer<K> optimizer;
+    for (auto &item: data) {
+        optimizer.add(item.first);
+    }
+
+    /* Tighter budgets need more levels */
+    size_t last_levels = 0;
+    for (size_t budget: {1ul << 30, 1ul << 20, 1ul << 16}) {
+        const auto strides = optimizer.optimize(budget, Table::SLOT_BYTES);
+        int total = 0;
+        for (int stride: strides) {
+            total += stride;
+        }
+        if (total != BITS_TOTAL
+            or optimizer.cost(strides, Table::SLOT_BYTES) > budget
+            or strides.size() < last_levels) {
+            std::cout << "TEST FAIL stride plan for " << budget << "B" << std::endl;
+            ret += 1;
+        }
+        last_levels = strides.size();
+
+        Table table(strides);
+        table.reserve(optimizer.nodes());
+        std::cout << "Generating flatstridesdyn" << name
+                  << " with " << strides.size() << " levels" << std::endl;
+        for (auto &item: data) {
+            table.add(item.first, item.second);
+        }
+        if (table.memory() > budget) {
+            std::cout << "TEST FAIL table over " << budget << "B" << std::endl;
+            ret += 1;
+        }
+        ret += Test::runner<>(table, testcases);
+    }
+
+    try {
+        optimizer.optimize(100, Table::SLOT_BYTES);
+        std::cout << "TEST FAIL impossible budget accepted" << std::endl;
+        ret += 1;
+    } catch (std::runtime_error &re) {
+    }
     return ret;
 }
 
@@ -290,6 +1032,11 @@ int main() {
 
     ret = testcase_map();
     ret += testcase_trie();
+    ret += testcase_dir24();
+    ret += testcase_poptrie();
+    ret += testcase_treebitmap();
+    ret += testcase_replicated();
+    ret += testcase_tablehandle();
     // meh
     ret += testcase_tritrie<1>();
     ret += testcase_tritrie<2>();
@@ -301,7 +1048,35 @@ int main() {
     ret += testcase_tritrie<8>();
 
     ret += testcase_ipv6<8>();
+    ret += testcase_ipv6<6>();
     ret += testcase_ipv6<4>();
+    ret += testcase_ipv6<3>();
+
+    ret += testcase_dualstack<8>();
+    ret += testcase_dualstack<6>();
+    ret += testcase_dualstack<4>();
+    ret += testcase_dualstack<3>();
+
+    using Tritrie::FlatStrides;
+    ret += testcase_strides<FlatStrides<16, 8, 8>>(
+        "<16, 8, 8>", Test::data_v4, Test::testcases_v4);
+    ret += testcase_strides<FlatStrides<16, 8, 4, 4>>(
+        "<16, 8, 4, 4>", Test::data_v4, Test::testcases_v4);
+    ret += testcase_strides<FlatStrides<3, 5, 7, 9, 8>>(
+        "<3, 5, 7, 9, 8>", Test::data_v4, Test::testcases_v4);
+    ret += testcase_strides<
+        Tritrie::FlatStridesT<int32_t, -500,
+                              16, 16, 16, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8>>(
+        "<16, 16, 16, 8, ...> IPv6", Test::data_v6, Test::testcases_v6);
+    ret += testcase_strides<
+        Tritrie::FlatStridesT<int32_t, -500,
+                              24, 24, 16, 16, 16, 5, 7, 4, 4, 4, 4, 4>>(
+        "<24, 24, 16, 16, 16, 5, 7, 4, ...> IPv6", Test::data_v6, Test::testcases_v6);
+
+    ret += testcase_strideopt<uint32_t, int32_t, -1>(
+        "", Test::data_v4, Test::testcases_v4);
+    ret += testcase_strideopt<Tritrie::uint128_t, int32_t, -500>(
+        " IPv6", Test::data_v6, Test::testcases_v6);
 
     return ret;
 }
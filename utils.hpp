@@ -6,9 +6,12 @@
 #ifndef _UTILS_H_
 #define _UTILS_H_
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <fstream>
+#include <utility>
+#include <type_traits>
 #include <boost/algorithm/string.hpp>
 
 #include <sys/socket.h>
@@ -18,7 +21,7 @@
 
 /** Measure execution time of a lambda */
 template<typename Fn>
-int measure(std::string desc, Fn execute) {
+uint64_t measure(std::string desc, Fn execute) {
     using std::chrono::system_clock;
     auto start = system_clock::now();
     execute();
@@ -83,6 +86,55 @@ void test_query(const std::string &name, T &algo,
 }
 
 
+/**
+ * Query structure in bursts using its query_batch API. Burst is filled with
+ * mutate_ip like in test_query, so the results are comparable. Key type is
+ * the one mutate_ip returns and value type the one algo.query returns;
+ * results equal to def count as not found.
+ */
+template<typename T, typename Fn,
+         typename K = std::decay_t<decltype(std::declval<Fn &>()(0))>,
+         typename V = std::decay_t<decltype(std::declval<const T &>().query(
+                                             std::declval<K>()))>>
+void test_query_batch(const std::string &name, T &algo,
+                      Fn mutate_ip,
+                      const int burst = 32,
+                      const int tests = 5000000,
+                      const V def = (V)-1) {
+    int found = 0, nx = 0;
+    std::vector<K> ips(burst);
+    std::vector<V> results(burst);
+    auto took = measure("",
+                        [&] () {
+                            for (int i = 0; i < tests; i += burst) {
+                                for (int j = 0; j < burst; j++) {
+                                    ips[j] = mutate_ip(i + j);
+                                }
+                                algo.query_batch(ips.data(), results.data(),
+                                                 burst);
+                                for (int j = 0; j < burst; j++) {
+                                    if (results[j] == def) {
+                                        nx += 1;
+                                    } else {
+                                        found += 1;
+                                    }
+                                }
+                            }
+                        });
+    const int done = found + nx;
+    const double per_s = done / (took / 1e9);
+    const double ns_per_q = 1.0 * took / done;
+    std::cout
+        << name << " finished (burst " << burst << "):" << std::endl
+        << "  found=" << 100.0 * found / done << "%"
+        << " (" << found << " / " << nx << ")" << std::endl
+        << "  queries " << done << " in " << took / 1e9 << "s -> "
+        << per_s / 1e6 << " Mq/s; "
+        << ns_per_q << " ns/q"
+        << std::endl;
+}
+
+
 /** Convert dot-ipv4 notation to network-byte-order binary */
 uint32_t ip_to_hl(const std::string &addr) {
     in_addr ip_parsed;
@@ -163,6 +215,24 @@ void show_mem_usage(bool quiet = false)
 }
 
 
+/** Read a kB counter like "AnonHugePages:  2048 kB" from a /proc file */
+long read_proc_kb(const std::string &path, const std::string &field)
+{
+    std::ifstream status(path);
+    std::string buffer;
+    std::vector<std::string> columns;
+    while (std::getline(status, buffer)) {
+        if (boost::starts_with(buffer, field + ":")) {
+            boost::split(columns, buffer, boost::is_any_of(" "),
+                         boost::algorithm::token_compress_on);
+            assert(columns.size() >= 2);
+            return atol(columns[1].c_str());
+        }
+    }
+    return -1;
+}
+
+
 uint32_t fastrand(void) {
     static unsigned long next = 1;
     next = next * 1103515245 + 12345;
@@ -194,32 +264,216 @@ std::vector<uint32_t> get_rnd_test_data(std::vector<std::string> &input_data,
 };
 
 
+/** Random 128-bit number */
+unsigned __int128 fastrand128(void) {
+    unsigned __int128 rnd = 0;
+    for (int i = 0; i < 5; i++) {
+        rnd = (rnd << 31) | fastrand();
+    }
+    return rnd;
+}
+
+/** Format host-order IPv6 address with a mask */
+std::string ipv6_to_string(unsigned __int128 ip, int mask) {
+    in6_addr addr;
+    for (int i = 0; i < 16; i++) {
+        addr.s6_addr[i] = ip >> (120 - 8 * i);
+    }
+    char buf[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &addr, buf, sizeof(buf));
+    return std::string(buf) + "/" + std::to_string(mask);
+}
+
+/**
+ * Generate a synthetic IPv6 table sorted by mask, shaped roughly like
+ * a global routing table: /29-/32 allocations within 2000::/3 and more
+ * specific prefixes within them, mostly /48, up to max_mask.
+ */
+std::vector<std::string> get_ipv6_test_data(int count = 200000,
+                                            int max_mask = 128) {
+    using u128 = unsigned __int128;
+    auto prefix = [] (u128 ip, int mask) {
+        return mask == 0 ? 0 : ip & (~(u128)0 << (128 - mask));
+    };
+
+    std::vector<std::pair<int, u128>> table;
+    const int allocations = count / 10;
+    for (int i = 0; i < allocations; i++) {
+        const u128 ip = ((u128)1 << 125) | (fastrand128() >> 3);
+        const int mask = 29 + fastrand() % 4;
+        table.push_back({mask, prefix(ip, mask)});
+    }
+
+    for (int i = allocations; i < count; i++) {
+        const auto &parent = table[fastrand() % allocations];
+        const int dice = fastrand() % 100;
+        int mask;
+        if (dice < 50) {
+            mask = 48;
+        } else if (dice < 70) {
+            mask = 33 + fastrand() % 15;
+        } else if (dice < 90) {
+            mask = 49 + fastrand() % 16;
+        } else {
+            mask = 65 + fastrand() % 64;
+        }
+        mask = std::min(mask, max_mask);
+        const u128 ip = parent.second | (fastrand128() >> parent.first);
+        table.push_back({mask, prefix(ip, mask)});
+    }
+
+    std::stable_sort(table.begin(), table.end(),
+                     [] (const auto &a, const auto &b) {
+                         return a.first < b.first;
+                     });
+    std::vector<std::string> data;
+    for (auto &entry: table) {
+        data.push_back(ipv6_to_string(entry.second, entry.first));
+    }
+    return data;
+}
+
+/**
+ * IPv6 table shaped like the real ones: mostly /29-/32 allocations, a few
+ * /33-/47 more specifics and even fewer /48 blocks.
+ */
+std::vector<std::string> get_ipv6_short_test_data(int count = 200000) {
+    using u128 = unsigned __int128;
+    auto prefix = [] (u128 ip, int mask) {
+        return ip & (~(u128)0 << (128 - mask));
+    };
+
+    std::vector<std::pair<int, u128>> table;
+    const int allocations = count * 7 / 10;
+    for (int i = 0; i < allocations; i++) {
+        const u128 ip = ((u128)1 << 125) | (fastrand128() >> 3);
+        const int mask = fastrand() % 4 == 0 ? 29 + fastrand() % 3 : 32;
+        table.push_back({mask, prefix(ip, mask)});
+    }
+
+    for (int i = allocations; i < count; i++) {
+        const auto &parent = table[fastrand() % allocations];
+        const int mask = fastrand() % 3 == 0 ? 48 : 33 + fastrand() % 15;
+        const u128 ip = parent.second | (fastrand128() >> parent.first);
+        table.push_back({mask, prefix(ip, mask)});
+    }
+
+    std::vector<std::string> data;
+    for (auto &entry: table) {
+        data.push_back(ipv6_to_string(entry.second, entry.first));
+    }
+    return data;
+}
+
+/** Random IPv6 addresses within random subnets of the input */
+std::vector<unsigned __int128> get_rnd_test_data_v6(
+    const std::vector<std::string> &input_data, int count = 5000000) {
+    const int input_len = input_data.size();
+    std::vector<unsigned __int128> data;
+    for (int i = 0; i < count; i++) {
+        unsigned __int128 netip;
+        int mask_n;
+        ip_from_string<unsigned __int128>(input_data[fastrand() % input_len],
+                                          netip, mask_n);
+        assert(mask_n != -1);
+        const unsigned __int128 host_rnd = (
+            mask_n == 128 ? 0 : fastrand128() & (~(unsigned __int128)0 >> mask_n));
+        data.push_back(netip | host_rnd);
+    }
+    return data;
+}
+
+/**
+ * Generate skewed query data: 90% of queries hit randomly chosen hot_count
+ * subnets, the rest is spread over all the input data.
+ */
+std::vector<uint32_t> get_skewed_test_data(std::vector<std::string> &input_data,
+                                           int hot_count,
+                                           int count=5000000) {
+    const int input_len = input_data.size();
+    std::vector<std::string> hot;
+    for (int i = 0; i < hot_count; i++) {
+        hot.push_back(input_data[fastrand() % input_len]);
+    }
+
+    auto data = get_rnd_test_data(hot, count - count / 10);
+    auto cold = get_rnd_test_data(input_data, count / 10);
+    data.insert(data.end(), cold.begin(), cold.end());
+
+    /* Mix hot and cold queries */
+    for (int i = count - 1; i > 0; i--) {
+        std::swap(data[i], data[fastrand() % (i + 1)]);
+    }
+    return data;
+}
+
+
 /** Load subnets from file and sort them by mask */
-std::vector<std::string> load_test_data(const std::string &path) {
+std::vector<std::string> load_test_data(const std::string &path,
+                                        bool sorted = true) {
     std::ifstream in(path);
     std::string line;
-    std::vector<std::string> addresses;
+    std::vector<std::pair<int, std::string>> addresses;
 
     while (getline(in, line)) {
-        addresses.push_back(line);
-    }
-
-    /* Sort by mask */
-    std::sort(addresses.begin(),
-              addresses.end(),
-              [](const std::string &a, const std::string &b) {
-                  int mask_a = 0, mask_b = 0;
-                  size_t found = a.find("/");
-                  assert(found != std::string::npos);
-                  std::from_chars(a.data() + found+1, a.data() + a.size(),
-                                  mask_a);
-
-                  found = b.find("/");
-                  std::from_chars(b.data() + found+1, b.data() + b.size(),
-                                  mask_b);
-                  return mask_a < mask_b;
-              });
+        int mask = 0;
+        size_t found = line.find("/");
+        assert(found != std::string::npos);
+        std::from_chars(line.data() + found + 1, line.data() + line.size(), mask);
+        addresses.push_back({mask, line});
+    }
+
+    /* Sort by mask - only needed by structures filled in order */
+    if (sorted) {
+        std::stable_sort(addresses.begin(),
+                         addresses.end(),
+                         [](const auto &a, const auto &b) {
+                             return a.first < b.first;
+                         });
+    }
+
+    std::vector<std::string> data;
+    data.reserve(addresses.size());
+    for (auto &address: addresses) {
+        data.push_back(std::move(address.second));
+    }
+    return data;
+}
+
+/* Networks from the first column of a GeoLite2 blocks file, sorted by mask */
+std::vector<std::string> load_csv_data(const std::string &path) {
+    std::ifstream ifile(path);
+    std::string line;
+    std::vector<std::string> row;
+    std::vector<std::pair<int, std::string>> networks;
+    std::getline(ifile, line); /* skip header */
+
+    while (std::getline(ifile, line)) {
+        boost::split(row, line, boost::is_any_of(","));
+        const std::string &network = row[0];
+        const size_t found = network.find("/");
+        int mask = 0;
+        std::from_chars(network.data() + found + 1,
+                        network.data() + network.size(), mask);
+        networks.push_back({mask, network});
+    }
+
+    std::stable_sort(networks.begin(), networks.end(),
+                     [] (const auto &a, const auto &b) {
+                         return a.first < b.first;
+                     });
+    std::vector<std::string> addresses;
+    for (auto &network: networks) {
+        addresses.push_back(network.second);
+    }
     return addresses;
 }
 
+/* Prefix list or a GeoLite2 blocks .csv file, sorted by mask */
+std::vector<std::string> load_data(const std::string &path) {
+    const bool csv = (path.size() > 4
+                      and path.compare(path.size() - 4, 4, ".csv") == 0);
+    return csv ? load_csv_data(path) : load_test_data(path);
+}
+
 #endif